@@ -0,0 +1,28 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+#include "types.h"
+
+#define BC_LRU 0       // Replacement policies
+#define BC_2Q  1
+
+// for `getbcachestat`
+struct bcachestat {
+    int policy;        // BC_LRU or BC_2Q
+    int nbuf;          // Buffers in the cache now
+    int maxbuf;        // High watermark it may grow to
+    int npage;         // Pages of buffers taken from kalloc
+    uint nhit;         // Lookups that found the block cached
+    uint nmiss;        // Lookups that had to recycle a buffer
+    uint nevict;       // Cached blocks recycled for others
+    uint ngrow;        // Pages added to the cache
+    uint nshrink;      // Pages given back to kalloc
+    int ncold;         // Unused buffers on the cold (probation) queue
+    int nhot;          // Unused buffers on the hot (main) queue
+    uint nhothit;      // Of the hits, ones on hot buffers
+    uint nreuse;       // Misses on lately evicted cold blocks, made hot
+    uint nprefetch;    // Blocks read ahead
+    uint nrahit;       // Of those, ones read before being evicted
+    uint nrawaste;     // Ones evicted without having been read
+};
+
+#endif
@@ -0,0 +1,41 @@
+// Report buffer cache statistics.
+//
+//   bcstat [max]
+//
+// With max, first sets the cache's high watermark to max
+// buffers, shrinking it if it is bigger than that.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "bcache.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct bcachestat st;
+  uint n, pct;
+
+  if(argc > 1 && setbcachemax(atoi(argv[1])) < 0){
+    printf(2, "bcstat: bad watermark %s\n", argv[1]);
+    exit();
+  }
+  if(getbcachestat(&st) < 0){
+    printf(2, "bcstat: getbcachestat failed\n");
+    exit();
+  }
+
+  n = st.nhit + st.nmiss;
+  pct = 0;
+  if(n > 0)
+    pct = n < 1000000 ? st.nhit * 100 / n : st.nhit / (n / 100);
+  printf(1, "%s: buffers %d of %d (%d pages), %d%% hits\n",
+         st.policy == BC_2Q ? "2q" : "lru", st.nbuf, st.maxbuf, st.npage, pct);
+  printf(1, "%d hits (%d hot), %d misses (%d reused), %d evictions\n",
+         st.nhit, st.nhothit, st.nmiss, st.nreuse, st.nevict);
+  printf(1, "%d unused cold, %d unused hot, %d grown, %d shrunk\n",
+         st.ncold, st.nhot, st.ngrow, st.nshrink);
+  printf(1, "%d read ahead, %d used, %d wasted\n",
+         st.nprefetch, st.nrahit, st.nrawaste);
+  exit();
+}
@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -8,6 +8,9 @@
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
+// * To keep several requests in flight, start each with
+//     breadasync or bwriteasync, then call biowait on each
+//     before using or releasing it.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -17,127 +20,623 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Cached blocks are found through a hash table on (dev, blockno)
+// with a lock per bucket, so lookups of different blocks do not
+// contend and do not slow down as NBUF grows.  Unused buffers
+// (refcnt 0) are also on one of two LRU queues, from which
+// bget() takes the buffer to recycle on a miss.
+//
+// The queues implement 2Q replacement, so that reading a big
+// file once does not push out inodes, bitmaps and directories.
+// A block read in starts on the cold queue, however often it
+// is used while there.  Once unused cold buffers make up more
+// than a quarter of the cache, misses recycle the oldest of
+// them, and each bucket remembers the last few blocks so
+// evicted.  A miss on one of those, a block used again after
+// a while rather than just in a burst, puts it on the hot
+// queue, which is recycled only when the cold one is small.
+// Building with BCACHE=lru puts every block on the hot queue,
+// for plain LRU.
+//
+// Besides the NBUF static buffers, the cache grows a page of
+// buffers at a time from kalloc() on a miss, while fewer than
+// bcache.maxbuf buffers are cached and more than BCACHERESERVE
+// pages are free.  When kalloc() runs dry it calls bshrink() to
+// give back a page whose buffers are all unused.
+//
+// Lock order: bcache.lock, then bucket locks, then bcache.lrulock.
+// bcache.lock lets only one miss at a time recycle a buffer;
+// that miss alone holds two bucket locks (its own and the
+// victim's), so it cannot deadlock with anyone.  A buffer's
+// refcnt and hash chain are guarded by its bucket's lock, and
+// its LRU links by bcache.lrulock.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
-#include "sleeplock.h"
+#include "mutex.h"
 #include "fs.h"
 #include "buf.h"
+#include "bcache.h"
+
+#define NODEV ((uint)-1)   // dev of a buffer in no bucket yet
+#define NGHOST 8           // evicted cold blocks each bucket remembers
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;      // buffers hashed here, through b->hnext
+  uint nhit;
+  uint nhothit;          // hits on hot buffers
+  struct {
+    uint dev;
+    uint blockno;
+  } ghost[NGHOST];       // blocks lately evicted from the cold queue
+  int nextghost;         // ghost slot to overwrite next
+};
+
+// A kalloc'd page of buffers.
+#define BPERPAGE ((PGSIZE - sizeof(void*)) / sizeof(struct buf))
+struct bpage {
+  struct bpage *next;
+  struct buf buf[BPERPAGE];
+};
 
 struct {
   struct spinlock lock;
   struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
+
+  // Guarded by lock:
+  struct bpage *pages;   // Pages of buffers, oldest first
+  int nbuf;
+  int maxbuf;
+  int npage;
+  uint nmiss;
+  uint nevict;
+  uint ngrow;
+  uint nshrink;
+  uint nreuse;
+  uint nrawaste;
+
+  // Updated atomically, without locks:
+  uint nprefetch;
+  uint nrahit;
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  // LRU queues of unused buffers, through prev/next.
+  // cold.next and hot.next are most recently used.
+  struct spinlock lrulock;
+  struct buf cold;       // probation: 2Q's A1in
+  struct buf hot;        // main: 2Q's Am
+  int ncold;
+  int nhot;
 } bcache;
 
 void
 binit(void)
 {
   struct buf *b;
+  int i, j;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.lrulock, "bcache lru");
+  bcache.nbuf = NBUF;
+  bcache.maxbuf = NBUFMAX;
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache bucket");
+    for(j = 0; j < NGHOST; j++)
+      bcache.bucket[i].ghost[j].dev = NODEV;
+  }
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Create linked lists of buffers
+  bcache.cold.prev = &bcache.cold;
+  bcache.cold.next = &bcache.cold;
+  bcache.hot.prev = &bcache.hot;
+  bcache.hot.next = &bcache.hot;
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->dev = NODEV;
+    b->hot = 0;
+    b->next = bcache.cold.next;
+    b->prev = &bcache.cold;
+    initmutex(&b->lock, "buffer");
+    bcache.cold.next->prev = b;
+    bcache.cold.next = b;
   }
+  bcache.ncold = NBUF;
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+static struct bucket*
+hash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Take b, which is unused, off its queue.
+// Caller must hold bcache.lrulock.
+static void
+unqueue(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  if(b->hot)
+    bcache.nhot--;
+  else
+    bcache.ncold--;
+}
+
+static void
+lruremove(struct buf *b)
+{
+  acquire(&bcache.lrulock);
+  unqueue(b);
+  release(&bcache.lrulock);
+}
+
+// Remember that the block in b, about to be evicted from the
+// cold queue, lived in bucket h, which must be locked.
+static void
+addghost(struct bucket *h, struct buf *b)
+{
+  h->ghost[h->nextghost].dev = b->dev;
+  h->ghost[h->nextghost].blockno = b->blockno;
+  h->nextghost = (h->nextghost + 1) % NGHOST;
+}
+
+#ifndef BCACHE_LRU
+// Was the block lately evicted from the cold queue?
+// If so, forget it.  Bucket h must be locked.
+static int
+isghost(struct bucket *h, uint dev, uint blockno)
+{
+  int i;
+
+  for(i = 0; i < NGHOST; i++){
+    if(h->ghost[i].dev == dev && h->ghost[i].blockno == blockno){
+      h->ghost[i].dev = NODEV;
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif
+
+// Look for the block in bucket h, which must be locked.
+// If found, take a reference to it.
 static struct buf*
-bget(uint dev, uint blockno)
+lookup(struct bucket *h, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = h->head; b; b = b->hnext){
     if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      if(b->refcnt++ == 0)
+        lruremove(b);
+      h->nhit++;
+      if(b->hot)
+        h->nhothit++;
       return b;
     }
   }
+  return 0;
+}
+
+// The least recently used buffer on queue q that may be
+// recycled, or 0.  Caller must hold bcache.lrulock.
+static struct buf*
+oldest(struct buf *q)
+{
+  struct buf *b;
 
-  // Not cached; recycle an unused buffer.
   // Even if refcnt==0, B_DIRTY indicates a buffer is in use
   // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  for(b = q->prev; b != q; b = b->prev)
+    if((b->flags & B_DIRTY) == 0)
+      return b;
+  return 0;
+}
+
+// Choose an unused buffer to recycle and lock its bucket,
+// unless that is h, which the caller has locked already.
+// If there is none, return 0 when trying, else panic.
+// Caller must hold bcache.lock.
+static struct buf*
+victim(struct bucket *h, int trying)
+{
+  struct buf *b;
+  struct bucket *old;
+
+  for(;;){
+    // Prefer a buffer holding no block, then the cold queue
+    // if it is over its share.
+    acquire(&bcache.lrulock);
+    b = oldest(&bcache.cold);
+    if(b && b->dev != NODEV && bcache.ncold <= bcache.nbuf/4)
+      b = 0;
+    if(b == 0)
+      b = oldest(&bcache.hot);
+    if(b == 0)
+      b = oldest(&bcache.cold);
+    release(&bcache.lrulock);
+    if(b == 0 && trying)
+      return 0;
+    if(b == 0)
+      panic("bget: no buffers");
+    if(b->dev == NODEV)
+      return b;
+
+    // Someone may take b between choosing and locking it.
+    old = hash(b->dev, b->blockno);
+    if(old != h)
+      acquire(&old->lock);
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
       return b;
+    if(old != h)
+      release(&old->lock);
+  }
+}
+
+// Add a page of buffers to the tail of the cold queue, where
+// the next miss will find them, if memory is not short.
+static void
+bgrow(void)
+{
+  struct bpage *pg;
+  struct buf *b;
+
+  if(kfreecount() <= BCACHERESERVE)
+    return;
+  if((pg = (struct bpage*)kalloc()) == 0)
+    return;
+  for(b = pg->buf; b < pg->buf+BPERPAGE; b++){
+    initmutex(&b->lock, "buffer");
+    b->dev = NODEV;
+    b->flags = 0;
+    b->refcnt = 0;
+    b->hot = 0;
+  }
+
+  acquire(&bcache.lock);
+  if(bcache.nbuf >= bcache.maxbuf){
+    // Someone else grew it meanwhile.
+    release(&bcache.lock);
+    kfree((char*)pg);
+    return;
+  }
+  acquire(&bcache.lrulock);
+  for(b = pg->buf; b < pg->buf+BPERPAGE; b++){
+    b->prev = bcache.cold.prev;
+    b->next = &bcache.cold;
+    bcache.cold.prev->next = b;
+    bcache.cold.prev = b;
+  }
+  bcache.ncold += BPERPAGE;
+  release(&bcache.lrulock);
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  bcache.nbuf += BPERPAGE;
+  bcache.npage++;
+  bcache.ngrow++;
+  release(&bcache.lock);
+}
+
+// Try to take all the buffers on pg out of the cache.
+// Caller must hold bcache.lock.  Returns 0 if some are
+// in use; those that were not may be dropped anyway.
+static int
+bdrain(struct bpage *pg)
+{
+  struct buf *b, **pp;
+  struct bucket *h;
+
+  // Cheap unlocked look first, to spare cached blocks on
+  // pages that are sure to fail.
+  for(b = pg->buf; b < pg->buf+BPERPAGE; b++)
+    if(b->refcnt || (b->flags & B_DIRTY))
+      return 0;
+
+  for(b = pg->buf; b < pg->buf+BPERPAGE; b++){
+    if(b->dev == NODEV)
+      continue;
+    h = hash(b->dev, b->blockno);
+    acquire(&h->lock);
+    if(b->refcnt || (b->flags & B_DIRTY)){
+      release(&h->lock);
+      return 0;
     }
+    for(pp = &h->head; *pp != b; pp = &(*pp)->hnext)
+      ;
+    *pp = b->hnext;
+    b->dev = NODEV;
+    release(&h->lock);
   }
-  panic("bget: no buffers");
+
+  // Unhashed and unused, they are reachable only through
+  // the queues, and only by holders of bcache.lock.
+  acquire(&bcache.lrulock);
+  for(b = pg->buf; b < pg->buf+BPERPAGE; b++)
+    unqueue(b);
+  release(&bcache.lrulock);
+  return 1;
 }
 
-// Return a locked buf with the contents of the indicated block.
+// Give a page of buffers back to kalloc(), if one has
+// no buffer in use.  Returns 1 if it freed a page.
+int
+bshrink(void)
+{
+  struct bpage *pg, **pp;
+
+  acquire(&bcache.lock);
+  for(pp = &bcache.pages; (pg = *pp) != 0; pp = &pg->next)
+    if(bdrain(pg))
+      break;
+  if(pg){
+    *pp = pg->next;
+    bcache.nbuf -= BPERPAGE;
+    bcache.npage--;
+    bcache.nshrink++;
+  }
+  release(&bcache.lock);
+  if(pg == 0)
+    return 0;
+  kfree((char*)pg);
+  return 1;
+}
+
+// Set the high watermark to max buffers and shrink down
+// to it as far as buffers in use allow.
+int
+setbcachemax(int max)
+{
+  if(max < NBUF)
+    return -1;
+  acquire(&bcache.lock);
+  bcache.maxbuf = max;
+  release(&bcache.lock);
+  while(bcache.nbuf > max && bshrink())
+    ;
+  return 0;
+}
+
+void
+getbcachestat(struct bcachestat *st)
+{
+  int i;
+
+  acquire(&bcache.lock);
+  st->nbuf = bcache.nbuf;
+  st->maxbuf = bcache.maxbuf;
+  st->npage = bcache.npage;
+  st->nmiss = bcache.nmiss;
+  st->nevict = bcache.nevict;
+  st->ngrow = bcache.ngrow;
+  st->nshrink = bcache.nshrink;
+  st->nreuse = bcache.nreuse;
+  st->ncold = bcache.ncold;
+  st->nhot = bcache.nhot;
+  st->nprefetch = bcache.nprefetch;
+  st->nrahit = bcache.nrahit;
+  st->nrawaste = bcache.nrawaste;
+  release(&bcache.lock);
+#ifdef BCACHE_LRU
+  st->policy = BC_LRU;
+#else
+  st->policy = BC_2Q;
+#endif
+  st->nhit = 0;
+  st->nhothit = 0;
+  for(i = 0; i < NBUCKET; i++){
+    st->nhit += bcache.bucket[i].nhit;
+    st->nhothit += bcache.bucket[i].nhothit;
+  }
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// If trying, return 0 rather than panic if no buffer is free.
+static struct buf*
+bget(uint dev, uint blockno, int trying)
+{
+  struct buf *b, **pp;
+  struct bucket *h, *old;
+
+  h = hash(dev, blockno);
+  acquire(&h->lock);
+
+  // Is the block already cached?
+  if((b = lookup(h, dev, blockno)) != 0){
+    release(&h->lock);
+    acquiremutex(&b->lock);
+    return b;
+  }
+  release(&h->lock);
+
+  // Not cached.  Grow the cache if it may, outside the locks
+  // since kalloc() may call bshrink().
+  if(bcache.nbuf < bcache.maxbuf)
+    bgrow();
+
+  // Recycle an unused buffer.  Look again once
+  // bcache.lock is ours: another miss may have read it in.
+  acquire(&bcache.lock);
+  acquire(&h->lock);
+  if((b = lookup(h, dev, blockno)) == 0){
+    if((b = victim(h, trying)) == 0){
+      release(&h->lock);
+      release(&bcache.lock);
+      return 0;
+    }
+    bcache.nmiss++;
+    lruremove(b);
+    if(b->dev != NODEV){
+      bcache.nevict++;
+      if(b->flags & B_PREFETCH)
+        bcache.nrawaste++;
+      old = hash(b->dev, b->blockno);
+      if(!b->hot)
+        addghost(old, b);
+      for(pp = &old->head; *pp != b; pp = &(*pp)->hnext)
+        ;
+      *pp = b->hnext;
+      if(old != h)
+        release(&old->lock);
+    }
+    b->dev = dev;
+    b->blockno = blockno;
+    b->flags = 0;
+    b->refcnt = 1;
+#ifdef BCACHE_LRU
+    b->hot = 1;
+#else
+    b->hot = isghost(h, dev, blockno);
+    if(b->hot)
+      bcache.nreuse++;
+#endif
+    b->hnext = h->head;
+    h->head = b;
+  }
+  release(&h->lock);
+  release(&bcache.lock);
+  acquiremutex(&b->lock);
+  return b;
+}
+
+// Return a locked buf for the indicated block, with a read of
+// its contents started if need be.  Call biowait before use.
 struct buf*
-bread(uint dev, uint blockno)
+breadasync(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if((b->flags & B_VALID) == 0) {
-    iderw(b);
+    idesubmit(b);
+  } else if(b->flags & B_PREFETCH){
+    b->flags &= ~B_PREFETCH;
+    __sync_fetch_and_add(&bcache.nrahit, 1);
   }
   return b;
 }
 
-// Write b's contents to disk.  Must be locked.
+// Return a locked buf with the contents of the indicated block.
+struct buf*
+bread(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = breadasync(dev, blockno);
+  biowait(b);
+  return b;
+}
+
+// Start reading the indicated block into the cache, if it
+// is not there already, without waiting for the disk.
+// Return -1 if no buffer was free to read it into; a
+// prefetch must never take the last one from a real read.
+int
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  if((b = bget(dev, blockno, 1)) == 0)
+    return -1;
+  if(b->flags & B_VALID){
+    brelse(b);
+    return 0;
+  }
+  b->flags |= B_ASYNC | B_PREFETCH;
+  __sync_fetch_and_add(&bcache.nprefetch, 1);
+  idesubmit(b);
+  return 0;
+}
+
+// The number of unused buffers, which a miss may recycle
+// unless log.c has them pinned.  Read without locks, so
+// only a hint.
+int
+bnidle(void)
+{
+  return bcache.ncold + bcache.nhot;
+}
+
+// Start writing b's contents to disk.  Must be locked, and
+// stays locked; call biowait before changing or releasing it.
 void
-bwrite(struct buf *b)
+bwriteasync(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
+  if(!holdingmutex(&b->lock))
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
+  idesubmit(b);
 }
 
-// Release a locked buffer.
-// Move to the head of the MRU list.
+// Write b's contents to disk.  Must be locked.
 void
-brelse(struct buf *b)
+bwrite(struct buf *b)
 {
-  if(!holdingsleep(&b->lock))
-    panic("brelse");
+  bwriteasync(b);
+  biowait(b);
+}
 
-  releasesleep(&b->lock);
+// Wait for the read or write started on locked buf b.
+void
+biowait(struct buf *b)
+{
+  if(!holdingmutex(&b->lock))
+    panic("biowait");
+  ideiowait(b);
+}
 
-  acquire(&bcache.lock);
+// Drop a reference to b, whose lock is released.
+// If no one else has it, move it to the head of its queue.
+static void
+bunref(struct buf *b)
+{
+  struct bucket *h;
+  struct buf *q;
+
+  h = hash(b->dev, b->blockno);
+  acquire(&h->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+    q = b->hot ? &bcache.hot : &bcache.cold;
+    acquire(&bcache.lrulock);
+    b->next = q->next;
+    b->prev = q;
+    q->next->prev = b;
+    q->next = b;
+    if(b->hot)
+      bcache.nhot++;
+    else
+      bcache.ncold++;
+    release(&bcache.lrulock);
+  }
+  release(&h->lock);
+}
+
+// Release a locked buffer.
+void
+brelse(struct buf *b)
+{
+  if(!holdingmutex(&b->lock))
+    panic("brelse");
+
+  releasemutex(&b->lock);
+  bunref(b);
+}
+
+// Release a buffer whose B_ASYNC request the disk driver has
+// finished.  Called from the disk interrupt.
+void
+biodone(struct buf *b)
+{
+  releasemutex(&b->lock);
+  bunref(b);
 }
 //PAGEBREAK!
 // Blank page.
@@ -2,13 +2,18 @@ struct buf {
   int flags;
   uint dev;
   uint blockno;
-  struct sleeplock lock;
+  struct mutex lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  struct buf *prev; // LRU list of unused buffers
   struct buf *next;
+  struct buf *hnext; // hash bucket chain
+  int hot;           // on the hot queue when unused? see bio.c
   struct buf *qnext; // disk queue
+  uint64 tsubmit;    // when queued for the disk, from rdtsc
   uchar data[BSIZE];
 };
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_ASYNC 0x8  // don't wait for the disk; it calls biodone()
+#define B_PREFETCH 0x10  // read ahead and not yet asked for
 
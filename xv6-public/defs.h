@@ -1,22 +1,39 @@
+struct bcachestat;
 struct buf;
 struct context;
 struct file;
+struct idestat;
 struct inode;
+struct lockstat;
+struct mutex;
 struct pipe;
+struct rwlock;
 struct proc;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
 struct pgdirinfo;
 struct wmapinfo;
+struct cpuinfo;
+struct pinfo;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     breadasync(uint, uint);
+int             bprefetch(uint, uint);
+int             bnidle(void);
+void            biodone(struct buf*);
+void            biowait(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwriteasync(struct buf*);
+int             bshrink(void);
+int             setbcachemax(int);
+void            getbcachestat(struct bcachestat*);
 
 // console.c
 void            consoleinit(void);
@@ -26,6 +43,7 @@ void            panic(char*) __attribute__((noreturn));
 
 // exec.c
 int             exec(char*, char**);
+int             loadimage(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -44,6 +62,7 @@ struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
@@ -55,10 +74,18 @@ int             readi(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint, int);
+int             futex_wake(uint, int);
+
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            idesubmit(struct buf*);
+void            ideiowait(struct buf*);
+void            getidestat(struct idestat*);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -67,7 +94,10 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+void            kdup(char*);
 void            kfree(char*);
+int             krefcount(char*);
+int             kfreecount(void);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 
@@ -81,14 +111,33 @@ extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
+void            lapicipi(uchar, int);
 void            microdelay(int);
 
+// lockprof.c
+struct lockstat* lockclass(char*, int);
+void            lockwaited(struct lockstat*, uint64, uint);
+void            lockheld(struct lockstat*, uint64);
+int             getlockstat(struct lockstat*, int);
+
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
 void            begin_op();
 void            end_op();
 
+// mutex.c
+void            acquiremutex(struct mutex*);
+void            releasemutex(struct mutex*);
+void            disownmutex(struct mutex*);
+int             holdingmutex(struct mutex*);
+void            initmutex(struct mutex*, char*);
+
+// pagecache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint, uint);
+void            pcinval(struct inode*);
+
 // mp.c
 extern int      ismp;
 void            mpinit(void);
@@ -108,19 +157,28 @@ int             pipewrite(struct pipe*, char*, int);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
+int             clone(void(*)(void*), void*, void*);
+int             join(void**);
+int             spawn(char*, char**, int*);
+int             getcpuinfo(struct cpuinfo*);
+int             getpinfo(struct pinfo*);
 int             growproc(int);
 int             kill(int);
-struct cpu*     mycpu(void);
-struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+void            schedinit(void);
+void            schedtick(void);
 void            setproc(struct proc*);
+int             setaffinity(uint);
+int             settickets(int);
 void            sleep(void*, struct spinlock*);
+int             sleeptimeout(void*, struct spinlock*, uint);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
+void            wakeupproc(struct proc*, void*);
 void            yield(void);
 
 // swtch.S
@@ -131,10 +189,19 @@ void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+uint            lockbench(int);
 void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// rwlock.c
+void            acquireread(struct rwlock*);
+void            acquirewrite(struct rwlock*);
+void            releaserw(struct rwlock*);
+void            downgraderw(struct rwlock*);
+int             holdingrw(struct rwlock*);
+void            initrwlock(struct rwlock*, char*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -160,6 +227,9 @@ void            syscall(void);
 
 // timer.c
 void            timerinit(void);
+void            timerset(struct timer*, uint, void(*)(void*), void*);
+void            timercancel(struct timer*);
+void            timertick(void);
 
 // trap.c
 void            idtinit(void);
@@ -179,6 +249,10 @@ pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
+void            unmapuvm(pde_t*, uint, uint);
+void            tlbshootdown(pde_t*);
+void            tlbpoll(void);
+int             countptpages(pde_t*);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
@@ -196,7 +270,7 @@ int             wunmap(uint);
 uint            wremap(uint, int, int, int);
 int             getpgdirinfo(struct pgdirinfo*);
 int             getwmapinfo(struct wmapinfo*);
-int             handle_pagefault(uint);
+int             handle_pagefault(uint, uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -7,17 +7,26 @@
 #include "x86.h"
 #include "elf.h"
 
+// Load the program at path into p, replacing its user image.
+// p is either the calling process (exec) or a new process
+// that has no image yet (spawn).  Returns -1 and leaves p
+// unchanged on error.  Fails if p shares its address space
+// with other threads.
 int
-exec(char *path, char **argv)
+loadimage(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nsegs;
   uint argc, sz, sp, ustack[3+MAXARG+1];
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe, *oldexe;
   struct proghdr ph;
+  struct segment segs[MAXLOADSEG];
   pde_t *pgdir, *oldpgdir;
-  struct proc *curproc = myproc();
+  struct vmspace *vm = p->vm;
+
+  if(vm->nthreads > 1)
+    return -1;
 
   begin_op();
 
@@ -26,8 +35,9 @@ exec(char *path, char **argv)
     cprintf("exec: fail\n");
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);
   pgdir = 0;
+  exe = 0;
 
   // Check ELF header
   if(readi(ip, (char*)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -38,8 +48,11 @@ exec(char *path, char **argv)
   if((pgdir = setupkvm()) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments.  Nothing is read yet:
+  // handle_pagefault() loads text and data pages from the
+  // executable on first touch and zero-fills the bss.
   sz = 0;
+  nsegs = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, (char*)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -49,15 +62,26 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    if((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz >= KERNBASE)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loaduvm(pgdir, (char*)ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.off + ph.filesz < ph.off)
+      goto bad;
+    if(nsegs == MAXLOADSEG)
       goto bad;
+    segs[nsegs].vaddr = ph.vaddr;
+    segs[nsegs].memsz = ph.memsz;
+    segs[nsegs].off = ph.off;
+    segs[nsegs].filesz = ph.filesz;
+    nsegs++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // Keep the reference to ip for demand loading.
+  iunlock(ip);
   end_op();
+  exe = ip;
   ip = 0;
 
   // Allocate two pages at the next page boundary.
@@ -91,16 +115,27 @@ exec(char *path, char **argv)
   for(last=s=path; *s; s++)
     if(*s == '/')
       last = s+1;
-  safestrcpy(curproc->name, last, sizeof(curproc->name));
+  safestrcpy(p->name, last, sizeof(p->name));
 
   // Commit to the user image.
-  oldpgdir = curproc->pgdir;
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
-  curproc->tf->eip = elf.entry;  // main
-  curproc->tf->esp = sp;
-  switchuvm(curproc);
-  freevm(oldpgdir);
+  oldpgdir = vm->pgdir;
+  oldexe = vm->exe;
+  vm->pgdir = pgdir;
+  vm->sz = sz;
+  vm->exe = exe;
+  memmove(vm->segs, segs, sizeof(segs));
+  vm->nsegs = nsegs;
+  p->tf->eip = elf.entry;  // main
+  p->tf->esp = sp;
+  if(p == myproc())
+    switchuvm(p);
+  if(oldpgdir)
+    freevm(oldpgdir);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
   return 0;
 
  bad:
@@ -110,5 +145,16 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
+
+int
+exec(char *path, char **argv)
+{
+  return loadimage(myproc(), path, argv);
+}
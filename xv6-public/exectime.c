@@ -0,0 +1,46 @@
+// Measure exec latency: fork and exec a program n times
+// and report the elapsed clock ticks.
+//
+//   exectime [n [prog args...]]
+//
+// With no program, re-executes itself with "-x", which exits
+// at once.  The ballast array makes this binary large, like a
+// program most of whose code and data never runs, so it shows
+// the cost of loading pages that are never touched.  To compare
+// two kernels, run "exectime 200" on each.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+char ballast[32*1024] = { 1 };
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, start, elapsed;
+  char *self[] = { "exectime", "-x", 0 };
+  char **args;
+
+  if(argc > 1 && strcmp(argv[1], "-x") == 0)
+    exit();
+
+  n = 100;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  args = argc > 2 ? &argv[2] : self;
+
+  start = uptime();
+  for(i = 0; i < n; i++){
+    if(fork() == 0){
+      exec(args[0], args);
+      printf(2, "exectime: exec %s failed\n", args[0]);
+      exit();
+    }
+    wait();
+  }
+  elapsed = uptime() - start;
+  printf(1, "exectime: %d execs of %s in %d ticks (%d ticks per 100)\n",
+         n, args[0], elapsed, n > 0 ? elapsed * 100 / n : 0);
+  exit();
+}
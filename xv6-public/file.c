@@ -19,7 +19,11 @@ struct {
 void
 fileinit(void)
 {
+  struct file *f;
+
   initlock(&ftable.lock, "ftable");
+  for(f = ftable.file; f < ftable.file + NFILE; f++)
+    initmutex(&f->offlock, "file offset");
 }
 
 // Allocate a file structure.
@@ -84,7 +88,7 @@ int
 filestat(struct file *f, struct stat *st)
 {
   if(f->type == FD_INODE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, st);
     iunlock(f->ip);
     return 0;
@@ -103,10 +107,15 @@ fileread(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    ilock(f->ip);
+    // Readers of one inode share its lock, so readers of the
+    // same open file need offlock to keep off consistent.
+    // Writers change off holding the inode lock exclusively.
+    acquiremutex(&f->offlock);
+    ilockshared(f->ip);
     if((r = readi(f->ip, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
+    releasemutex(&f->offlock);
     return r;
   }
   panic("fileread");
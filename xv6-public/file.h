@@ -1,4 +1,5 @@
-#include "sleeplock.h"
+#include "mutex.h"
+#include "rwlock.h"
 struct file {
   enum { FD_NONE, FD_PIPE, FD_INODE } type;
   int ref; // reference count
@@ -7,6 +8,7 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  struct mutex offlock; // serializes readers of off; see fileread
 };
 
 
@@ -15,7 +17,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
-  struct sleeplock lock; // protects everything below here
+  struct rwlock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
   short type;         // copy of disk inode
@@ -24,6 +26,11 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  // Readahead state: hints, updated by readers sharing the lock.
+  uint ranext;        // block a sequential reader reads next
+  uint rawin;         // blocks to read ahead of it, 0 if not sequential
+  uint raend;         // blocks below this have been read ahead
 };
 
 // table mapping major device number to
@@ -16,7 +16,8 @@
 #include "mmu.h"
 #include "proc.h"
 #include "spinlock.h"
-#include "sleeplock.h"
+#include "mutex.h"
+#include "rwlock.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -134,7 +135,9 @@ bfree(int dev, uint b)
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
-//   has first locked the inode.
+//   has first locked the inode.  ilockshared() locks it
+//   for examining only, so that readers of a file (read,
+//   exec, page faults, path lookup) can run in parallel.
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -175,7 +178,7 @@ iinit(int dev)
   
   initlock(&icache.lock, "icache");
   for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+    initrwlock(&icache.inode[i].lock, "inode");
   }
 
   readsb(dev, &sb);
@@ -266,6 +269,9 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->rawin = 0;
+  ip->raend = 0;
   release(&icache.lock);
 
   return ip;
@@ -293,7 +299,7 @@ ilock(struct inode *ip)
   if(ip == 0 || ip->ref < 1)
     panic("ilock");
 
-  acquiresleep(&ip->lock);
+  acquirewrite(&ip->lock);
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -311,14 +317,34 @@ ilock(struct inode *ip)
   }
 }
 
-// Unlock the given inode.
+// Lock the given inode shared, for reading only: the
+// caller may look at it and readi() it but not change it.
+// Reads the inode from disk if necessary.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  acquireread(&ip->lock);
+  if(ip->valid)
+    return;
+
+  // Loading it from disk changes it, so do that exclusively.
+  // Someone else may load it in between; ilock() checks.
+  releaserw(&ip->lock);
+  ilock(ip);
+  downgraderw(&ip->lock);
+}
+
+// Unlock the given inode, locked by ilock or ilockshared.
 void
 iunlock(struct inode *ip)
 {
-  if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
+  if(ip == 0 || !holdingrw(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
-  releasesleep(&ip->lock);
+  releaserw(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
@@ -331,7 +357,7 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquiresleep(&ip->lock);
+  acquirewrite(&ip->lock);
   if(ip->valid && ip->nlink == 0){
     acquire(&icache.lock);
     int r = ip->ref;
@@ -344,7 +370,7 @@ iput(struct inode *ip)
       ip->valid = 0;
     }
   }
-  releasesleep(&ip->lock);
+  releaserw(&ip->lock);
 
   acquire(&icache.lock);
   ip->ref--;
@@ -411,6 +437,7 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcinval(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -446,6 +473,49 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Note a read of blocks first through last of ip, and if
+// the reads so far look sequential, start reading ahead of
+// them.  The window starts at RAMIN blocks and doubles, up
+// to RAMAX, while the reader keeps going; a jump resets it.
+// It is also kept to half the idle buffers, so that blocks
+// read ahead are not recycled before they are read.
+// Caller must hold ip->lock, shared will do.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, nblocks, win;
+
+  if(first == ip->ranext){
+    if(ip->rawin == 0)
+      ip->rawin = RAMIN;
+    else if(ip->rawin < RAMAX)
+      ip->rawin *= 2;
+  } else if(first + 1 != ip->ranext){
+    // Not sequential, nor more of the block read last.
+    ip->rawin = 0;
+    ip->raend = 0;
+  }
+  ip->ranext = last + 1;
+  if(ip->rawin == 0)
+    return;
+
+  win = bnidle() / 2;
+  if(win > ip->rawin)
+    win = ip->rawin;
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = last + 1 + win;
+  if(end > nblocks)
+    end = nblocks;
+  bn = last + 1;
+  if(bn < ip->raend)
+    bn = ip->raend;
+  for(; bn < end; bn++)
+    if(bprefetch(ip->dev, bmap(ip, bn)) < 0)
+      break;
+  if(bn > ip->raend)
+    ip->raend = bn;
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
@@ -465,6 +535,8 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     return -1;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(n > 0)
+    readahead(ip, off/BSIZE, (off+n-1)/BSIZE);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -494,6 +566,8 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(n > 0)
+    pcinval(ip);  // cached executable pages are now stale
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -632,7 +706,7 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    ilockshared(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
       return 0;
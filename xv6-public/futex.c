@@ -0,0 +1,170 @@
+// Futexes: sleep until another thread or process changes a
+// word of user memory.
+//
+// futex_wait(addr, val) sleeps if the word at addr still holds
+// val, and futex_wake(addr, n) wakes up to n of the sleepers.
+// Sleepers are keyed by the physical address of the word, so
+// processes that share a page through a MAP_SHARED region
+// inherited across fork find each other even though the page
+// need not be at the same virtual address in each.
+//
+// Sleepers are kept on per-bucket queues hashed by key, so a
+// wake looks only at processes waiting on the same bucket.
+// Lock order: vm->lock, then the bucket lock, then ptable.lock.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+struct futexq {
+  struct spinlock lock;
+  struct proc *head;     // sleepers, linked through p->fnext
+};
+
+struct futexq futexq[NFUTEXQ];
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFUTEXQ; i++)
+    initlock(&futexq[i].lock, "futex");
+}
+
+static struct futexq*
+hashkey(uint key)
+{
+  return &futexq[(key >> 2) % NFUTEXQ];
+}
+
+// Acquire vm->lock and return the physical address of the
+// word at user address addr, or 0 if it cannot be mapped.
+// Faults the page in first, so that lazily loaded and wmap
+// pages work, and breaks copy-on-write: a waiter keyed on a
+// shared read-only frame would never see the wake from a
+// writer, whose store moved the word to a new frame.
+static uint
+futexkey(struct vmspace *vm, uint addr)
+{
+  pte_t *pte;
+  uint err;
+  int readonly;
+
+  readonly = 0;
+  for(;;){
+    acquire(&vm->lock);
+    if(addr % 4 != 0 || addr >= KERNBASE)
+      return 0;
+    pte = walkpgdir(vm->pgdir, (void*)addr, 0);
+    err = 0;
+    if(pte && (*pte & PTE_P)){
+      if(!(*pte & PTE_U))
+        return 0;
+      if((*pte & PTE_W) || readonly)
+        return PTE_ADDR(*pte) | (addr & (PGSIZE-1));
+      err = FEC_PR|FEC_WR;
+    }
+    release(&vm->lock);
+    // The fault handler takes vm->lock and may sleep.
+    if(!handle_pagefault(PGROUNDDOWN(addr), err)){
+      if(err == 0){
+        acquire(&vm->lock);
+        return 0;
+      }
+      readonly = 1;  // truly read-only; no one can store to it
+    }
+  }
+}
+
+// If the word at addr holds val, sleep until futex_wake() on
+// it.  Returns 0 when woken, and -1 if the word did not hold
+// val, addr is not mapped, or the process was killed.
+int
+futex_wait(uint addr, int val)
+{
+  struct proc *p = myproc();
+  struct vmspace *vm = p->vm;
+  struct futexq *q;
+  struct proc **pp;
+  uint key;
+
+  if((key = futexkey(vm, addr)) == 0){
+    release(&vm->lock);
+    return -1;
+  }
+  q = hashkey(key);
+  acquire(&q->lock);
+  // Read through the kernel mapping: the page cannot go away
+  // while vm->lock is held, and the bucket lock makes the
+  // check and the sleep atomic with respect to futex_wake().
+  if(*(int*)P2V(key) != val){
+    release(&q->lock);
+    release(&vm->lock);
+    return -1;
+  }
+  release(&vm->lock);
+
+  // Queue in arrival order, so wakes are first come, first served.
+  for(pp = &q->head; *pp; pp = &(*pp)->fnext)
+    ;
+  *pp = p;
+  p->fnext = 0;
+  p->fkey = key;
+  while(p->fkey && !p->killed)
+    sleep(&p->fkey, &q->lock);
+
+  if(p->fkey == 0){
+    release(&q->lock);
+    return 0;
+  }
+  // Killed while waiting: take ourselves off the queue.
+  for(pp = &q->head; *pp; pp = &(*pp)->fnext){
+    if(*pp == p){
+      *pp = p->fnext;
+      break;
+    }
+  }
+  p->fkey = 0;
+  release(&q->lock);
+  return -1;
+}
+
+// Wake up to n processes sleeping in futex_wait() on the word
+// at addr.  Returns the number woken.
+int
+futex_wake(uint addr, int n)
+{
+  struct vmspace *vm = myproc()->vm;
+  struct futexq *q;
+  struct proc **pp, *p;
+  uint key;
+  int woken;
+
+  key = futexkey(vm, addr);
+  release(&vm->lock);
+  if(key == 0)
+    return -1;
+
+  woken = 0;
+  q = hashkey(key);
+  acquire(&q->lock);
+  pp = &q->head;
+  while(*pp && woken < n){
+    p = *pp;
+    if(p->fkey != key){
+      pp = &p->fnext;
+      continue;
+    }
+    *pp = p->fnext;
+    p->fkey = 0;
+    wakeupproc(p, &p->fkey);
+    woken++;
+  }
+  release(&q->lock);
+  return woken;
+}
@@ -9,9 +9,10 @@
 #include "x86.h"
 #include "traps.h"
 #include "spinlock.h"
-#include "sleeplock.h"
+#include "mutex.h"
 #include "fs.h"
 #include "buf.h"
+#include "idestat.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -24,15 +25,31 @@
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+#define IDE_CMD_SETMULT 0xc6
+
+#define IDE_NMULT     8   // most sectors in one merged command
+
+// Requests wait on idepending, sorted by (dev, blockno), and
+// are served in C-LOOK order: the disk takes the next request
+// at or beyond the last block it served, wrapping around to
+// the lowest when none is left above.  Requests for adjacent
+// blocks in the same direction go to the disk together as one
+// multi-sector command; ideactive is the run now in progress,
+// nactive buffers long, linked through qnext.
+// You must hold idelock while manipulating the queues.
 
 static struct spinlock idelock;
-static struct buf *idequeue;
+static struct buf *idepending;
+static struct buf *ideactive;
+static int nactive;
+static uint lastdev, lastblock;   // where the last run ended
+static int npending;
+static uint64 tstart;             // when ideactive started
 
 static int havedisk1;
-static void idestart(struct buf*);
+static int nmult[2];              // sectors per command, by drive
+static struct idestat stats;
+static void idestart(struct buf*, int);
 
 // Wait for IDE disk to become ready.
 static int
@@ -47,6 +64,21 @@ idewait(int checkerr)
   return 0;
 }
 
+// Let drive d transfer IDE_NMULT sectors per interrupt,
+// for merged commands.  Without that, it gets one block
+// per command.
+static void
+idesetmult(int d)
+{
+  outb(0x1f6, 0xe0 | (d<<4));
+  outb(0x1f2, IDE_NMULT);
+  outb(0x1f7, IDE_CMD_SETMULT);
+  if(idewait(1) >= 0)
+    nmult[d] = IDE_NMULT;
+  else
+    nmult[d] = BSIZE/SECTOR_SIZE;
+}
+
 void
 ideinit(void)
 {
@@ -55,6 +87,7 @@ ideinit(void)
   initlock(&idelock, "ide");
   ioapicenable(IRQ_IDE, ncpu - 1);
   idewait(0);
+  idesetmult(0);
 
   // Check if disk 1 is present
   outb(0x1f6, 0xe0 | (1<<4));
@@ -64,105 +97,229 @@ ideinit(void)
       break;
     }
   }
+  if(havedisk1)
+    idesetmult(1);
 
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Start the run of n requests for adjacent blocks beginning
+// with b.  Caller must hold idelock.
 static void
-idestart(struct buf *b)
+idestart(struct buf *b, int n)
 {
+  struct buf *p;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  if(b->blockno + n > FSSIZE)
     panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  int nsector = n * sector_per_block;
+  int read_cmd = (nsector == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
+  int write_cmd = (nsector == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
-  if (sector_per_block > 7) panic("idestart");
+  if (nsector > nmult[b->dev&1] && nsector > 1) panic("idestart");
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, nsector);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    for(p = b; n-- > 0; p = p->qnext)
+      outsl(0x1f0, p->data, BSIZE/4);
   } else {
     outb(0x1f7, read_cmd);
   }
 }
 
+// Could p join a run that ends with b?
+static int
+canmerge(struct buf *b, struct buf *p, int n)
+{
+  return p && p->dev == b->dev && p->blockno == b->blockno + 1 &&
+    (p->flags & B_DIRTY) == (b->flags & B_DIRTY) &&
+    (n + 1) * (BSIZE/SECTOR_SIZE) <= nmult[b->dev&1];
+}
+
+// Take the next run off idepending and start it.
+// Caller must hold idelock, and the disk must be idle.
+static void
+idenext(void)
+{
+  struct buf *b, **pp, **start;
+  uint64 now;
+  int n, w;
+
+  if(idepending == 0)
+    return;
+
+  // C-LOOK: the first request at or past the last one served,
+  // else the lowest.
+  start = &idepending;
+  for(pp = &idepending; *pp; pp = &(*pp)->qnext){
+    if((*pp)->dev > lastdev ||
+       ((*pp)->dev == lastdev && (*pp)->blockno >= lastblock)){
+      start = pp;
+      break;
+    }
+  }
+
+  // Gather the run and cut it out of the queue.
+  b = *start;
+  for(n = 1; canmerge(b, b->qnext, n); n++)
+    b = b->qnext;
+  ideactive = *start;
+  nactive = n;
+  *start = b->qnext;
+  b->qnext = 0;
+  npending -= n;
+  lastdev = b->dev;
+  lastblock = b->blockno + 1;
+
+  now = rdtsc();
+  w = (ideactive->flags & B_DIRTY) != 0;
+  stats.ncmd[w]++;
+  for(b = ideactive; b; b = b->qnext)
+    stats.qcycles[w] += now - b->tsubmit;
+  tstart = now;
+  idestart(ideactive, nactive);
+}
+
 // Interrupt handler.
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *next, *done;
+  uint64 now, lat;
+  int w, err;
 
-  // First queued buffer is the active request.
+  // ideactive is the run the interrupt is for.
   acquire(&idelock);
 
-  if((b = idequeue) == 0){
+  if(ideactive == 0){
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
   // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  err = 0;
+  if(!(ideactive->flags & B_DIRTY))
+    err = idewait(1) < 0;
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+  now = rdtsc();
+  w = (ideactive->flags & B_DIRTY) != 0;
+  done = 0;
+  for(b = ideactive; b; b = next){
+    next = b->qnext;
+    if(!w && !err)
+      insl(0x1f0, b->data, BSIZE/4);
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+    stats.nreq[w]++;
+    stats.scycles[w] += now - tstart;
+    lat = now - b->tsubmit;
+    if(lat > stats.maxcycles[w])
+      stats.maxcycles[w] = lat;
+
+    // Wake process waiting for this buf, or set aside
+    // an async one for biodone().
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC){
+      b->qnext = done;
+      done = b;
+    } else
+      wakeup(b);
+  }
+  ideactive = 0;
+  nactive = 0;
+
+  // Start disk on next run in queue.
+  idenext();
 
   release(&idelock);
+
+  // No one waits for an async request; let go of b for them.
+  for(b = done; b; b = next){
+    next = b->qnext;
+    b->flags &= ~B_ASYNC;
+    biodone(b);
+  }
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
+// Start syncing buf with disk, without waiting.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Unless B_ASYNC is set, the caller keeps b locked and calls
+// ideiowait() before using it.  If B_ASYNC is set, b belongs
+// to the disk, and ideintr() hands it to biodone() when done.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
   struct buf **pp;
 
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
+  if(!holdingmutex(&b->lock))
+    panic("idesubmit: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+    panic("idesubmit: nothing to do");
   if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+    panic("idesubmit: ide disk 1 not present");
+
+  if(b->flags & B_ASYNC)
+    disownmutex(&b->lock);
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
+  // Insert b into idepending in block order.
+  b->tsubmit = rdtsc();
+  for(pp=&idepending; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+    if((*pp)->dev > b->dev ||
+       ((*pp)->dev == b->dev && (*pp)->blockno > b->blockno))
+      break;
+  b->qnext = *pp;
   *pp = b;
+  if(++npending > stats.maxdepth)
+    stats.maxdepth = npending;
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(ideactive == 0)
+    idenext();
+
+  release(&idelock);
+}
 
-  // Wait for request to finish.
+// Wait for the request idesubmit() started on b to finish.
+void
+ideiowait(struct buf *b)
+{
+  acquire(&idelock);
   while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
     sleep(b, &idelock);
   }
+  release(&idelock);
+}
 
+// Sync buf with disk, waiting for it unless B_ASYNC is set.
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+  if(!(b->flags & B_ASYNC))
+    ideiowait(b);
+}
 
+// Copy out the disk queue statistics.
+void
+getidestat(struct idestat *st)
+{
+  acquire(&idelock);
+  *st = stats;
   release(&idelock);
 }
@@ -0,0 +1,15 @@
+#ifndef IDESTAT_H
+#define IDESTAT_H
+#include "types.h"
+
+// for `getidestat`; arrays are indexed 0 for reads, 1 for writes
+struct idestat {
+    uint nreq[2];            // Requests completed
+    uint ncmd[2];            // Disk commands they were merged into
+    uint64 qcycles[2];       // Total cycles requests waited in the queue
+    uint64 scycles[2];       // Total cycles requests spent at the disk
+    uint64 maxcycles[2];     // Longest time from queueing to completion
+    int maxdepth;            // Most requests queued at once
+};
+
+#endif
@@ -0,0 +1,33 @@
+// Report disk queue statistics.
+//
+//   iostat
+//
+// For reads and writes: requests completed, the disk commands
+// they were merged into, and the average cycles a request spent
+// queued and at the disk, with the worst total.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "idestat.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct idestat st;
+  char *what[2] = { "read", "write" };
+  int w;
+
+  if(getidestat(&st) < 0){
+    printf(2, "iostat: getidestat failed\n");
+    exit();
+  }
+  for(w = 0; w < 2; w++){
+    printf(1, "%s: %d requests in %d commands\n", what[w], st.nreq[w], st.ncmd[w]);
+    printf(1, "  avg cycles queued %d, at disk %d; max total %d Kcycles\n",
+           div64(st.qcycles[w], st.nreq[w]), div64(st.scycles[w], st.nreq[w]),
+           (uint)(st.maxcycles[w] >> 10));
+  }
+  printf(1, "max queue depth %d\n", st.maxdepth);
+  exit();
+}
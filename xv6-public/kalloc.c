@@ -21,6 +21,8 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree;                   // pages on freelist
+  ushort ref[PHYSTOP/PGSIZE];  // references to each allocated page
 } kmem;
 
 // Initialization happens in two phases.
@@ -52,10 +54,11 @@ freerange(void *vstart, void *vend)
     kfree(p);
 }
 //PAGEBREAK: 21
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it when the last reference
+// goes away.  (The exception is when initializing the
+// allocator; see kinit above.)
 void
 kfree(char *v)
 {
@@ -64,6 +67,18 @@ kfree(char *v)
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if(kmem.ref[V2P(v)/PGSIZE] > 1){
+    kmem.ref[V2P(v)/PGSIZE]--;
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    return;
+  }
+  kmem.ref[V2P(v)/PGSIZE] = 0;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
@@ -72,6 +87,7 @@ kfree(char *v)
   r = (struct run*)v;
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   if(kmem.use_lock)
     release(&kmem.lock);
 }
@@ -79,18 +95,65 @@ kfree(char *v)
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// If none is free, takes pages back from the buffer cache,
+// so callers must not hold buffer cache locks.
 char*
 kalloc(void)
 {
   struct run *r;
 
+  do {
+    if(kmem.use_lock)
+      acquire(&kmem.lock);
+    r = kmem.freelist;
+    if(r){
+      kmem.freelist = r->next;
+      kmem.nfree--;
+      kmem.ref[V2P(r)/PGSIZE] = 1;
+    }
+    if(kmem.use_lock)
+      release(&kmem.lock);
+  } while(r == 0 && kmem.use_lock && bshrink());
+  return (char*)r;
+}
+
+// Return the number of free pages, which may be stale
+// by the time the caller looks at it.
+int
+kfreecount(void)
+{
+  return kmem.nfree;
+}
+
+// Add a reference to the allocated page v, so that it can
+// be mapped in more than one place.  Each reference is
+// dropped with kfree().
+void
+kdup(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kdup");
+
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
+  if(kmem.ref[V2P(v)/PGSIZE] < 1)
+    panic("kdup: free page");
+  kmem.ref[V2P(v)/PGSIZE]++;
   if(kmem.use_lock)
     release(&kmem.lock);
-  return (char*)r;
+}
+
+// Return the number of references to the allocated page v.
+int
+krefcount(char *v)
+{
+  int n;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  n = kmem.ref[V2P(v)/PGSIZE];
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return n;
 }
 
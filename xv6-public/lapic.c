@@ -160,6 +160,17 @@ lapicstartap(uchar apicid, uint addr)
   }
 }
 
+// Send interrupt vector to the CPU with the given APIC ID.
+// Must be called with interrupts disabled.
+void
+lapicipi(uchar apicid, int vector)
+{
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
 #define CMOS_STATA   0x0a
 #define CMOS_STATB   0x0b
 #define CMOS_UIP    (1 << 7)        // RTC update in progress
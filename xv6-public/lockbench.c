@@ -0,0 +1,72 @@
+// Measure the cost of a kernel spinlock acquire/release pair.
+//
+//   lockbench [nproc [n]]
+//
+// Runs nproc processes at once, the i'th pinned to cpu i, each
+// timing n acquire/release pairs of one shared kernel lock, and
+// reports each one's cycles per pair.  With one process the
+// lock is uncontended, which shows the fixed cost: pushcli,
+// popcli and the mycpu() lookups they do.  There can be at
+// most one process per cpu.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "sched.h"
+
+int
+main(int argc, char *argv[])
+{
+  int i, nproc, n, fds[2];
+  uint cycles;
+  struct cpuinfo ci;
+
+  nproc = 1;
+  n = 100000;
+  if(argc > 1)
+    nproc = atoi(argv[1]);
+  if(argc > 2)
+    n = atoi(argv[2]);
+  if(nproc < 1 || n < 1 || n > 1000000){
+    printf(2, "usage: lockbench [nproc [n]]\n");
+    exit();
+  }
+  if(getcpuinfo(&ci) < 0){
+    printf(2, "lockbench: getcpuinfo failed\n");
+    exit();
+  }
+  if(nproc > ci.ncpu){
+    printf(2, "lockbench: %d processes but only %d cpus\n", nproc, ci.ncpu);
+    exit();
+  }
+
+  if(pipe(fds) < 0){
+    printf(2, "lockbench: pipe failed\n");
+    exit();
+  }
+  for(i = 0; i < nproc; i++){
+    if(fork() == 0){
+      close(fds[0]);
+      if(setaffinity(1 << i) < 0){
+        printf(2, "lockbench: cannot pin to cpu %d\n", i);
+        exit();
+      }
+      cycles = lockbench(n);
+      write(fds[1], &cycles, sizeof(cycles));
+      exit();
+    }
+  }
+  close(fds[1]);
+  // Only the parent prints, so the reports do not interleave.
+  for(i = 0; i < nproc; i++){
+    if(read(fds[0], &cycles, sizeof(cycles)) != sizeof(cycles)){
+      printf(2, "lockbench: only %d of %d processes reported\n", i, nproc);
+      break;
+    }
+    printf(1, "lockbench: %d pairs in %d cycles (%d per pair)\n",
+           n, cycles, cycles / n);
+  }
+  for(i = 0; i < nproc; i++)
+    wait();
+  exit();
+}
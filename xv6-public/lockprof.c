@@ -0,0 +1,105 @@
+// Lock profiling.
+//
+// Each lock belongs to the class named when it is initialized,
+// so that, say, all the inode sleeplocks are counted together.
+// For each class we keep histograms of how long acquirers
+// waited and how long holders held the lock, in rdtsc cycles,
+// and the callers that most often had to wait.
+//
+// The counters are updated by holders without further locking.
+// That is exact for a class of one lock; in classes of many,
+// such as inodes or pipes, holders of two different locks can
+// race and lose the odd count.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "lockstat.h"
+
+static struct {
+  uint locked;  // Taken with xchg alone: initlock() runs before mycpu() works
+  int n;
+  struct lockstat class[NLOCKCLASS];
+} lockclasses;
+
+// Return the class of locks named name, creating it if need be.
+struct lockstat*
+lockclass(char *name, int sleep)
+{
+  struct lockstat *ls;
+
+  while(xchg(&lockclasses.locked, 1) != 0)
+    ;
+  for(ls = lockclasses.class; ls < &lockclasses.class[lockclasses.n]; ls++)
+    if(ls->sleep == sleep && strncmp(ls->name, name, sizeof(ls->name)) == 0)
+      goto found;
+  if(lockclasses.n == NLOCKCLASS)
+    panic("lockclass");
+  ls = &lockclasses.class[lockclasses.n++];
+  safestrcpy(ls->name, name, sizeof(ls->name));
+  ls->sleep = sleep;
+found:
+  xchg(&lockclasses.locked, 0);
+  return ls;
+}
+
+// Histogram bucket for a duration: floor(log2(cycles)).
+static int
+bucket(uint64 cycles)
+{
+  int b;
+
+  for(b = 0; cycles > 1 && b < NLOCKHIST-1; b++)
+    cycles >>= 1;
+  return b;
+}
+
+// Record that the caller at pc waited cycles for a lock of
+// class ls, which it now holds.
+void
+lockwaited(struct lockstat *ls, uint64 cycles, uint pc)
+{
+  int i, min;
+
+  ls->ncontended++;
+  ls->waitcycles += cycles;
+  ls->waithist[bucket(cycles)]++;
+
+  // Count pc if it is one of the callers kept; otherwise it
+  // takes over the least counted one and its count, so that
+  // a frequent waiter soon works its way in.
+  min = 0;
+  for(i = 0; i < NLOCKPC; i++){
+    if(ls->pc[i] == pc){
+      ls->npc[i]++;
+      return;
+    }
+    if(ls->npc[i] < ls->npc[min])
+      min = i;
+  }
+  ls->pc[min] = pc;
+  ls->npc[min]++;
+}
+
+// Record that a lock of class ls, about to be released, was
+// held for cycles.
+void
+lockheld(struct lockstat *ls, uint64 cycles)
+{
+  ls->nacquire++;
+  ls->holdcycles += cycles;
+  ls->holdhist[bucket(cycles)]++;
+}
+
+// Copy out up to n lock classes; return how many were copied.
+// The counters are read without locks, so classes in use may
+// be caught between updates.
+int
+getlockstat(struct lockstat *ls, int n)
+{
+  if(n > lockclasses.n)
+    n = lockclasses.n;
+  memmove(ls, lockclasses.class, n * sizeof(*ls));
+  return n;
+}
@@ -0,0 +1,75 @@
+// Report kernel lock contention.
+//
+//   lockstat [n]
+//
+// Prints the n lock classes (default 10) whose acquirers spent
+// the most cycles waiting, with totals, averages, histograms of
+// wait and hold times, and the callers that waited most often.
+// Look the callers up in kernel.asm.  Histogram bucket i counts
+// times of 2^i to 2^(i+1)-1 cycles; empty buckets are skipped.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "lockstat.h"
+
+struct lockstat ls[NLOCKCLASS];
+
+void
+hist(char *what, uint *h)
+{
+  int i;
+
+  printf(1, "  %s:", what);
+  for(i = 0; i < NLOCKHIST; i++)
+    if(h[i])
+      printf(1, " 2^%d:%d", i, h[i]);
+  printf(1, "\n");
+}
+
+void
+report(struct lockstat *l)
+{
+  int i;
+
+  printf(1, "%s (%s): %d acquired, %d contended\n", l->name,
+         l->sleep ? "sleep" : "spin", l->nacquire, l->ncontended);
+  printf(1, "  wait %d Kcycles (avg %d), hold %d Kcycles (avg %d)\n",
+         (uint)(l->waitcycles >> 10), div64(l->waitcycles, l->ncontended),
+         (uint)(l->holdcycles >> 10), div64(l->holdcycles, l->nacquire));
+  hist("wait", l->waithist);
+  hist("hold", l->holdhist);
+  for(i = 0; i < NLOCKPC; i++)
+    if(l->npc[i])
+      printf(1, "  waiter %x: %d\n", l->pc[i], l->npc[i]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, k, n, nclass, order[NLOCKCLASS];
+
+  n = 10;
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n < 1){
+    printf(2, "usage: lockstat [n]\n");
+    exit();
+  }
+
+  nclass = getlockstat(ls, NLOCKCLASS);
+  if(nclass < 0){
+    printf(2, "lockstat: getlockstat failed\n");
+    exit();
+  }
+
+  // Insertion sort, most wait cycles first.
+  for(i = 0; i < nclass; i++){
+    for(j = i; j > 0 && ls[order[j-1]].waitcycles < ls[i].waitcycles; j--)
+      order[j] = order[j-1];
+    order[j] = i;
+  }
+  for(k = 0; k < nclass && k < n; k++)
+    report(&ls[order[k]]);
+  exit();
+}
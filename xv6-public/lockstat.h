@@ -0,0 +1,23 @@
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+#include "types.h"
+
+#define NLOCKCLASS 32   // maximum number of lock classes
+#define NLOCKHIST  32   // histogram buckets
+#define NLOCKPC     4   // contending callers kept per class
+
+// for `getlockstat`: the locks initialized under one name
+struct lockstat {
+    char name[16];              // Name given to initlock or initsleeplock
+    int sleep;                  // Sleeplocks rather than spinlocks?
+    uint nacquire;              // Acquisitions released so far
+    uint ncontended;            // Acquisitions that had to wait
+    uint64 waitcycles;          // Total cycles spent waiting
+    uint64 holdcycles;          // Total cycles held
+    uint waithist[NLOCKHIST];   // Waits; bucket i counts 2^i to 2^(i+1)-1 cycles
+    uint holdhist[NLOCKHIST];   // Holds, bucketed the same way
+    uint pc[NLOCKPC];           // Callers that most often had to wait
+    uint npc[NLOCKPC];          // Roughly how often each did
+};
+
+#endif
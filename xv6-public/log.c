@@ -2,7 +2,7 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
-#include "sleeplock.h"
+#include "mutex.h"
 #include "fs.h"
 #include "buf.h"
 
@@ -65,19 +65,29 @@ initlog(int dev)
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location,
+// LOGBATCH writes at a time.
 static void
 install_trans(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
+  struct buf *dbuf[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+i+1); // read log block
+      dbuf[i] = bread(log.dev, log.lh.block[tail+i]); // read dst
+      memmove(dbuf[i]->data, lbuf->data, BSIZE);  // copy block to dst
+      bwriteasync(dbuf[i]);  // start writing dst to disk
+      brelse(lbuf);
+    }
+    for (i = 0; i < n; i++) {
+      biowait(dbuf[i]);
+      brelse(dbuf[i]);
+    }
   }
 }
 
@@ -173,19 +183,29 @@ end_op(void)
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to log, LOGBATCH writes
+// at a time.  All are on disk before write_head() commits.
 static void
 write_log(void)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  struct buf *to[LOGBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < log.lh.n; tail += n) {
+    n = log.lh.n - tail;
+    if (n > LOGBATCH)
+      n = LOGBATCH;
+    for (i = 0; i < n; i++) {
+      to[i] = bread(log.dev, log.start+tail+i+1); // log block
+      struct buf *from = bread(log.dev, log.lh.block[tail+i]); // cache block
+      memmove(to[i]->data, from->data, BSIZE);
+      bwriteasync(to[i]);  // start writing the log
+      brelse(from);
+    }
+    for (i = 0; i < n; i++) {
+      biowait(to[i]);
+      brelse(to[i]);
+    }
   }
 }
 
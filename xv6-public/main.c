@@ -27,8 +27,11 @@ main(void)
   consoleinit();   // console hardware
   uartinit();      // serial port
   pinit();         // process table
+  futexinit();     // futex wait queues
   tvinit();        // trap vectors
+  schedinit();     // scheduler priority boosts
   binit();         // buffer cache
+  pcinit();        // executable page cache
   fileinit();      // file table
   ideinit();       // disk 
   startothers();   // start other processors
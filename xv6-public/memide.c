@@ -9,9 +9,10 @@
 #include "x86.h"
 #include "traps.h"
 #include "spinlock.h"
-#include "sleeplock.h"
+#include "mutex.h"
 #include "fs.h"
 #include "buf.h"
+#include "idestat.h"
 
 extern uchar _binary_fs_img_start[], _binary_fs_img_size[];
 
@@ -35,19 +36,21 @@ ideintr(void)
 // Sync buf with disk.
 // If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
 // Else if B_VALID is not set, read buf from disk, set B_VALID.
+// The copy is synchronous, so a B_ASYNC request is done, and
+// handed to biodone(), before returning.
 void
-iderw(struct buf *b)
+idesubmit(struct buf *b)
 {
   uchar *p;
 
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
+  if(!holdingmutex(&b->lock))
+    panic("idesubmit: buf not locked");
   if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
+    panic("idesubmit: nothing to do");
   if(b->dev != 1)
-    panic("iderw: request not for disk 1");
+    panic("idesubmit: request not for disk 1");
   if(b->blockno >= disksize)
-    panic("iderw: block out of range");
+    panic("idesubmit: block out of range");
 
   p = memdisk + b->blockno*BSIZE;
 
@@ -57,4 +60,27 @@ iderw(struct buf *b)
   } else
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
+  if(b->flags & B_ASYNC){
+    b->flags &= ~B_ASYNC;
+    biodone(b);
+  }
+}
+
+// Requests finish in idesubmit(); nothing to wait for.
+void
+ideiowait(struct buf *b)
+{
+}
+
+void
+iderw(struct buf *b)
+{
+  idesubmit(b);
+}
+
+// Requests are not queued; there is nothing to report.
+void
+getidestat(struct idestat *st)
+{
+  memset(st, 0, sizeof(*st));
 }
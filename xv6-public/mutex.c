@@ -0,0 +1,126 @@
+// Adaptive mutexes.
+//
+// Most inode and buffer holds are short, and a waiter that
+// goes through sleep and wakeup pays two context switches for
+// them.  So while the owner is running on another CPU, and
+// will likely let go soon, a waiter spins; only when the owner
+// itself sleeps (on the disk, say) or is preempted does the
+// waiter queue up and sleep.
+//
+// Release hands the mutex straight to the oldest sleeper, so
+// a sleeper cannot be starved by spinners coming and going,
+// and wakes just that one process.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "mutex.h"
+
+// On the sleeping process's stack while it waits.
+struct mutexwaiter {
+  struct proc *p;
+  struct mutexwaiter *next;
+};
+
+void
+initmutex(struct mutex *m, char *name)
+{
+  initlock(&m->lk, "mutex");
+  m->name = name;
+  m->owner = 0;
+  m->head = 0;
+  m->tail = 0;
+  m->stat = lockclass(name, 1);
+}
+
+void
+acquiremutex(struct mutex *m)
+{
+  struct mutexwaiter w;
+  struct proc *o;
+  uint64 t;
+  int waited;
+
+  waited = 0;
+  t = rdtsc();
+  acquire(&m->lk);
+  while((o = m->owner) != 0){
+    if(o == myproc())
+      panic("acquiremutex");
+    waited = 1;
+    if(o->state == RUNNING){
+      // o is on another CPU.  Wait for it to let go or to
+      // stop running, without holding m->lk.  Proc structs
+      // are never freed, so looking at o is safe, if stale.
+      release(&m->lk);
+      while(*(struct proc* volatile*)&m->owner == o &&
+            *(volatile enum procstate*)&o->state == RUNNING)
+        pause();
+      acquire(&m->lk);
+      continue;
+    }
+    // Queue up and sleep until release hands m over.
+    w.p = myproc();
+    w.next = 0;
+    if(m->tail)
+      m->tail->next = &w;
+    else
+      m->head = &w;
+    m->tail = &w;
+    while(m->owner != w.p)
+      sleep(&w, &m->lk);
+    break;
+  }
+  m->owner = myproc();
+  if(waited)
+    lockwaited(m->stat, rdtsc() - t, (uint)__builtin_return_address(0));
+  m->tacquire = rdtsc();
+  release(&m->lk);
+}
+
+void
+releasemutex(struct mutex *m)
+{
+  struct mutexwaiter *w;
+
+  acquire(&m->lk);
+  lockheld(m->stat, rdtsc() - m->tacquire);
+  if((w = m->head) != 0){
+    m->head = w->next;
+    if(m->head == 0)
+      m->tail = 0;
+    m->owner = w->p;
+    // Holding m->lk, which w->p gives up only once asleep,
+    // so w->p is sure to be sleeping on w.
+    wakeupproc(w->p, w);
+  } else
+    m->owner = 0;
+  release(&m->lk);
+}
+
+// Stands in as the owner of mutexes handed to the disk.  It
+// never runs, so their waiters sleep rather than spin.
+static struct proc ioowner;
+
+// Give up ownership of m, held by the caller, to an I/O in
+// progress; whoever finishes the I/O calls releasemutex().
+void
+disownmutex(struct mutex *m)
+{
+  acquire(&m->lk);
+  lockheld(m->stat, rdtsc() - m->tacquire);
+  m->owner = &ioowner;
+  m->tacquire = rdtsc();
+  release(&m->lk);
+}
+
+int
+holdingmutex(struct mutex *m)
+{
+  return m->owner == myproc();
+}
@@ -0,0 +1,18 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+#include "spinlock.h"
+// Adaptive locks for processes: spin while the holder runs,
+// sleep while it does not.
+struct mutex {
+  struct proc *owner;          // Process holding the mutex, or 0
+  struct mutexwaiter *head;    // Sleeping waiters, oldest first
+  struct mutexwaiter *tail;
+  struct spinlock lk;          // spinlock protecting this mutex
+
+  // For debugging:
+  char *name;                  // Name of mutex.
+  struct lockstat *stat;       // Profile of this mutex's class; see lockprof.c
+  uint64 tacquire;             // When the owner got the mutex, from rdtsc
+};
+
+#endif
@@ -0,0 +1,168 @@
+// Executable page cache.
+//
+// Caches the pages of executables that handle_pagefault() loads
+// on demand, so that every process running the same binary maps
+// the same physical frames read-only instead of reading its own
+// copy from disk.  A write to such a page takes a copy-on-write
+// fault and gets a private copy.
+//
+// Entries are keyed by inode and by the file extent the page
+// holds: n bytes from offset off, zero-filled to a full page.
+// The cache holds one kalloc() reference to each page and every
+// mapping holds another, so an entry can be recycled only once
+// no process maps its page.
+//
+// Writing to or truncating an inode drops its entries, so later
+// loads see the new contents.  Both pcget() misses and pcinval()
+// run with the inode locked, which keeps them ordered.  Few
+// inodes written have cached pages, so pcinval() first checks a
+// count of entries per inode hash and skips the scan if it is 0.
+// The count lives here rather than in struct inode since
+// entries outlive the in-memory inode, recycled once unused.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+struct pcentry {
+  uint dev;
+  uint inum;
+  uint off;      // file offset of the first byte in the page
+  uint n;        // bytes read from the file; the rest is zero
+  char *page;    // 0 if the entry is free
+  uint lastuse;
+};
+
+#define NPCHASH 64   // inode hash buckets counting entries
+
+struct {
+  struct spinlock lock;
+  struct pcentry ent[NPCACHE];
+  uint clock;
+  int ninode[NPCHASH];   // entries of inodes hashing to each
+} pcache;
+
+static int*
+ninode(uint dev, uint inum)
+{
+  return &pcache.ninode[(dev * 31 + inum) % NPCHASH];
+}
+
+void
+pcinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+}
+
+// Look up the page for (ip, off, n).  If found, add a
+// reference for the caller and return it.
+// Caller must hold pcache.lock.
+static char*
+pclookup(struct inode *ip, uint off, uint n)
+{
+  struct pcentry *e;
+
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    if(e->page && e->dev == ip->dev && e->inum == ip->inum &&
+       e->off == off && e->n == n){
+      e->lastuse = ++pcache.clock;
+      kdup(e->page);
+      return e->page;
+    }
+  }
+  return 0;
+}
+
+// Return a page holding n bytes of ip from offset off, with a
+// reference the caller must drop with kfree().  The page is
+// shared with other processes and must be mapped read-only.
+// Returns 0 on error.  ip must not be locked.
+char*
+pcget(struct inode *ip, uint off, uint n)
+{
+  struct pcentry *e, *victim;
+  char *mem, *cached;
+
+  acquire(&pcache.lock);
+  mem = pclookup(ip, off, n);
+  release(&pcache.lock);
+  if(mem)
+    return mem;
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  ilockshared(ip);
+  if(readi(ip, mem, off, n) != n){
+    iunlock(ip);
+    kfree(mem);
+    return 0;
+  }
+
+  acquire(&pcache.lock);
+  // Another process may have read the page in meanwhile.
+  if((cached = pclookup(ip, off, n)) != 0){
+    release(&pcache.lock);
+    iunlock(ip);
+    kfree(mem);
+    return cached;
+  }
+  // Choose a free entry, or else the least recently used
+  // entry whose page no process maps any more.
+  victim = 0;
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    if(e->page == 0){
+      victim = e;
+      break;
+    }
+    if(krefcount(e->page) == 1 &&
+       (victim == 0 || e->lastuse < victim->lastuse))
+      victim = e;
+  }
+  if(victim){
+    if(victim->page){
+      kfree(victim->page);
+      victim->page = 0;
+      (*ninode(victim->dev, victim->inum))--;
+    }
+    victim->dev = ip->dev;
+    victim->inum = ip->inum;
+    victim->off = off;
+    victim->n = n;
+    victim->lastuse = ++pcache.clock;
+    victim->page = mem;
+    kdup(mem);
+    (*ninode(ip->dev, ip->inum))++;
+  }
+  release(&pcache.lock);
+  iunlock(ip);
+  // If every entry is in use, the page stays private to the caller.
+  return mem;
+}
+
+// Drop the cached pages of ip.  Pages that processes still
+// map stay valid for them.  Caller must hold ip->lock.
+void
+pcinval(struct inode *ip)
+{
+  struct pcentry *e;
+
+  // Read without the lock: with ip locked, pcget() cannot
+  // add entries for ip, so a count of 0 stays 0.
+  if(*ninode(ip->dev, ip->inum) == 0)
+    return;
+  acquire(&pcache.lock);
+  for(e = pcache.ent; e < &pcache.ent[NPCACHE]; e++){
+    if(e->page && e->dev == ip->dev && e->inum == ip->inum){
+      kfree(e->page);
+      e->page = 0;
+      (*ninode(ip->dev, ip->inum))--;
+    }
+  }
+  release(&pcache.lock);
+}
@@ -7,8 +7,28 @@
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define MAXLOADSEG    4  // max loadable ELF segments per executable
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define LOGBATCH      8  // log block writes kept in flight at once
+// The static buffers are the floor the cache never shrinks below
+// (see setbcachemax), so they must hold a full log's dirty blocks,
+// pinned until commit, plus the LOGBATCH written at once by
+// write_log/install_trans, with MAXOPBLOCKS left for the source
+// block, the log header and other readers.
+#define NBUF         (LOGSIZE+LOGBATCH+MAXOPBLOCKS)  // size of disk block cache
+#define NBUCKET       64  // buffer cache hash buckets
+#define NBUFMAX     8192  // default buffer cache high watermark
+#define BCACHERESERVE 256  // free pages the buffer cache leaves to others
+#define RAMIN          4  // first readahead window, in blocks
+#define RAMAX         32  // largest readahead window, in blocks
 #define FSSIZE       1000  // size of file system in blocks
+#define NPCACHE       256  // size of executable page cache
+#define NFUTEXQ        64  // futex wait queue hash buckets
+#define NSLEEPQ        64  // sleep channel hash buckets
+#define NTIMER       (2*NPROC)  // maximum number of pending kernel timers
+#define NMLFQ         3  // scheduler priority levels (see mlfqslice in proc.c)
+#define MLFQBOOST   100  // ticks between boosts of all processes to level 0
+#define STRIDE1   10000  // stride of a process holding one ticket
+#define BALANCETICKS 10  // ticks between load-balancing passes
 
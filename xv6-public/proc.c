@@ -4,12 +4,21 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "timer.h"
+#include "sched.h"
 
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct vmspace vm[NPROC];
+  struct fdtable fdt[NPROC];
+  // Sleeping processes, hashed by channel and linked through
+  // p->snext, so that wakeup() looks only at processes that
+  // may be sleeping on its channel.
+  struct proc *sleepq[NSLEEPQ];
 } ptable;
 
 static struct proc *initproc;
@@ -19,11 +28,43 @@ extern void forkret(void);
 extern void trapret(void);
 
 static void wakeup1(void *chan);
+static void makerunnable(struct proc *p);
+
+// Time slice, in ticks, at each priority level.  A process
+// that uses up its slice at a level drops to the next one.
+static int mlfqslice[NMLFQ] = { 1, 2, 4 };
+
+static struct timer boosttimer;
+static struct timer balancetimer;
+
+// Stride scheduling, chosen at build time with make SCHED=stride,
+// replaces the feedback queues: each process advances its pass by
+// its stride for every tick it runs, and every cpu runs the
+// lowest pass in the system next, so cpu time divides in
+// proportion to tickets however the processes are spread out.
+#ifdef SCHED_STRIDE
+static int stridesched = 1;
+#else
+static int stridesched = 0;
+#endif
+
+// Pass of the latest process dispatched; a process that has
+// been asleep starts again from here rather than from a pass
+// so far behind that it would monopolize the cpus.
+static uint globalpass;
 
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = 0; i < NPROC; i++){
+    initlock(&ptable.vm[i].lock, "vmspace");
+    initlock(&ptable.fdt[i].lock, "fdtable");
+  }
+  for(i = 0; i < NCPU; i++)
+    initlock(&cpus[i].rq.lock, "runq");
 }
 
 // Must be called with interrupts disabled
@@ -32,39 +73,6 @@ cpuid() {
   return mycpu()-cpus;
 }
 
-// Must be called with interrupts disabled to avoid the caller being
-// rescheduled between reading lapicid and running through the loop.
-struct cpu*
-mycpu(void)
-{
-  int apicid, i;
-  
-  if(readeflags()&FL_IF)
-    panic("mycpu called with interrupts enabled\n");
-  
-  apicid = lapicid();
-  // APIC IDs are not guaranteed to be contiguous. Maybe we should have
-  // a reverse map, or reserve a register to store &cpus[i].
-  for (i = 0; i < ncpu; ++i) {
-    if (cpus[i].apicid == apicid)
-      return &cpus[i];
-  }
-  panic("unknown apicid\n");
-}
-
-// Disable interrupts so that we are not rescheduled
-// while reading proc from the cpu structure
-struct proc*
-myproc(void) {
-  struct cpu *c;
-  struct proc *p;
-  pushcli();
-  c = mycpu();
-  p = c->proc;
-  popcli();
-  return p;
-}
-
 //PAGEBREAK: 32
 // Look in the process table for an UNUSED proc.
 // If found, change state to EMBRYO and initialize
@@ -88,6 +96,16 @@ allocproc(void)
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->cpu = cpuid();
+  p->level = 0;
+  p->slice = 0;
+  memset(p->runticks, 0, sizeof p->runticks);
+  p->nsched = 0;
+  p->tickets = myproc() ? myproc()->tickets : 1;
+  p->stride = STRIDE1 / p->tickets;
+  p->pass = globalpass;
+  p->affinity = myproc() ? myproc()->affinity : ~0;
+  p->nmigrate = 0;
 
   release(&ptable.lock);
 
@@ -111,11 +129,69 @@ found:
   p->context = (struct context*)sp;
   memset(p->context, 0, sizeof *p->context);
   p->context->eip = (uint)forkret;
-  p->num_mappings = 0;
+  p->vm = 0;
+  p->fdt = 0;
+  p->ustack = 0;
 
   return p;
 }
 
+// Allocate an empty address space and an empty file table
+// for p.  Every process holds at most one of each, so there
+// is always a free one.
+static void
+allocspace(struct proc *p)
+{
+  struct vmspace *vm;
+  struct fdtable *fdt;
+
+  acquire(&ptable.lock);
+  for(vm = ptable.vm; vm < &ptable.vm[NPROC]; vm++)
+    if(vm->ref == 0)
+      break;
+  for(fdt = ptable.fdt; fdt < &ptable.fdt[NPROC]; fdt++)
+    if(fdt->ref == 0)
+      break;
+  if(vm == &ptable.vm[NPROC] || fdt == &ptable.fdt[NPROC])
+    panic("allocspace");
+  vm->ref = 1;
+  vm->nthreads = 1;
+  vm->sz = 0;
+  vm->pgdir = 0;
+  vm->num_mappings = 0;
+  vm->exe = 0;
+  vm->nsegs = 0;
+  fdt->ref = 1;
+  memset(fdt->ofile, 0, sizeof(fdt->ofile));
+  release(&ptable.lock);
+  p->vm = vm;
+  p->fdt = fdt;
+}
+
+// Drop p's reference to its address space, freeing the page
+// table with the last one, and free p.  p must be a zombie, or
+// an embryo that never ran.  Caller must hold ptable.lock.
+static void
+freeproc(struct proc *p)
+{
+  struct vmspace *vm = p->vm;
+
+  kfree(p->kstack);
+  p->kstack = 0;
+  if(vm && --vm->ref == 0 && vm->pgdir){
+    freevm(vm->pgdir);
+    vm->pgdir = 0;
+  }
+  p->vm = 0;
+  p->fdt = 0;
+  p->ustack = 0;
+  p->pid = 0;
+  p->parent = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+  p->state = UNUSED;
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
@@ -125,12 +201,13 @@ userinit(void)
   extern char _binary_initcode_start[], _binary_initcode_size[];
 
   p = allocproc();
+  allocspace(p);
   
   initproc = p;
-  if((p->pgdir = setupkvm()) == 0)
+  if((p->vm->pgdir = setupkvm()) == 0)
     panic("userinit: out of memory?");
-  inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
-  p->sz = PGSIZE;
+  inituvm(p->vm->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
+  p->vm->sz = PGSIZE;
   memset(p->tf, 0, sizeof(*p->tf));
   p->tf->cs = (SEG_UCODE << 3) | DPL_USER;
   p->tf->ds = (SEG_UDATA << 3) | DPL_USER;
@@ -149,29 +226,39 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  makerunnable(p);
 
   release(&ptable.lock);
 }
 
 // Grow current process's memory by n bytes.
+// Growth is lazy: only the size changes here, and handle_pagefault()
+// allocates each heap page on first touch.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
   uint sz;
-  struct proc *curproc = myproc();
+  struct vmspace *vm = myproc()->vm;
 
-  sz = curproc->sz;
+  acquire(&vm->lock);
+  sz = vm->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if(sz + n < sz || sz + n > MMAPBASE){
+      release(&vm->lock);
       return -1;
+    }
+    sz += n;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if(sz + n > sz){
+      release(&vm->lock);
       return -1;
+    }
+    sz += n;
+    unmapuvm(vm->pgdir, PGROUNDUP(sz), PGROUNDUP(vm->sz));
   }
-  curproc->sz = sz;
-  switchuvm(curproc);
+  vm->sz = sz;
+  release(&vm->lock);
   return 0;
 }
 
@@ -184,49 +271,46 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *curproc = myproc();
+  struct vmspace *vm = curproc->vm;
 
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
+  allocspace(np);
 
-  // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+  // Copy process state from proc.  Other threads may be
+  // changing the address space, so hold its lock.
+  acquire(&vm->lock);
+  if((np->vm->pgdir = copyuvm(vm->pgdir, vm->sz)) == 0){
+    release(&vm->lock);
+    acquire(&ptable.lock);
+    np->fdt->ref = 0;
+    freeproc(np);
+    release(&ptable.lock);
     return -1;
   }
 
-  np->sz = curproc->sz;
+  np->vm->sz = vm->sz;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
-
-  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
-
-  pid = np->pid;
-
-  acquire(&ptable.lock);
-
-  np->state = RUNNABLE;
-
-  release(&ptable.lock);
+  if(vm->exe)
+    np->vm->exe = idup(vm->exe);
+  memmove(np->vm->segs, vm->segs, sizeof(vm->segs));
+  np->vm->nsegs = vm->nsegs;
 
   // Initialize the success flag
   int success = 1;
   // Copy the number of mappings
-  np->num_mappings = curproc->num_mappings;
-  for (int i = 0; i < curproc->num_mappings; i++) {
+  np->vm->num_mappings = vm->num_mappings;
+  for (int i = 0; i < vm->num_mappings; i++) {
     // Get current mapping
-    struct mapping cur_map = curproc->mappings[i];
+    struct mapping cur_map = vm->mappings[i];
+    np->vm->mappings[i] = cur_map;
     if (cur_map.addr % PGSIZE != 0) {
       success = 0;
       break;
@@ -239,22 +323,23 @@ fork(void)
         success = 0;
         break;
       }
-      pte_t *pte = walkpgdir(curproc->pgdir, (void *)addr, 0);
+      pte_t *pte = walkpgdir(vm->pgdir, (void *)addr, 0);
       // Check if the page is mapped
-      if (*pte && (*pte & PTE_P)) {
+      if (pte && (*pte & PTE_P)) {
         // if private
         if (cur_map.flags & MAP_SHARED) { // if shared, simply move pages over
-          if (mappages(np->pgdir, (void *)addr, PGSIZE, PTE_ADDR(*pte), PTE_U | PTE_W) < 0) {
+          if (mappages(np->vm->pgdir, (void *)addr, PGSIZE, PTE_ADDR(*pte), PTE_U | PTE_W) < 0) {
             success = 0;
             break;
           }
+          kdup(P2V(PTE_ADDR(*pte)));
         } else { // else private
           char* mem = kalloc();
           if(mem == 0) {
             success = 0;
             break;
           }
-          if (mappages(np->pgdir, (void *)addr, PGSIZE, V2P(mem), PTE_U | PTE_W) < 0) {
+          if (mappages(np->vm->pgdir, (void *)addr, PGSIZE, V2P(mem), PTE_U | PTE_W) < 0) {
             success = 0;
             break;
           }
@@ -265,10 +350,139 @@ fork(void)
       offset += PGSIZE;
     }
   }
+  release(&vm->lock);
+
+  for(i = 0; i < NOFILE; i++)
+    if(curproc->fdt->ofile[i])
+      np->fdt->ofile[i] = filedup(curproc->fdt->ofile[i]);
+  np->cwd = idup(curproc->cwd);
+
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+
+  makerunnable(np);
+
+  release(&ptable.lock);
+
   if (!success) {
     return FAILED;
   }
-  lcr3(V2P(np->pgdir));
+
+  return pid;
+}
+
+// Create a thread: a child that shares the caller's address
+// space and open files, and starts in fn(arg) on the one-page
+// user stack at stack.  Returns the child's pid, or -1.
+int
+clone(void (*fn)(void*), void *arg, void *stack)
+{
+  int pid;
+  uint sp, ustack[2];
+  struct proc *np;
+  struct proc *curproc = myproc();
+
+  if((uint)stack % PGSIZE != 0)
+    return -1;
+
+  // Build the new thread's first frame: fn sees arg as its
+  // argument and a fake return PC, like main in exec.
+  ustack[0] = 0xffffffff;
+  ustack[1] = (uint)arg;
+  sp = (uint)stack + PGSIZE - sizeof(ustack);
+  memmove((void*)sp, ustack, sizeof(ustack));
+
+  if((np = allocproc()) == 0)
+    return -1;
+
+  acquire(&ptable.lock);
+  np->vm = curproc->vm;
+  np->vm->ref++;
+  np->vm->nthreads++;
+  np->fdt = curproc->fdt;
+  np->fdt->ref++;
+  release(&ptable.lock);
+
+  np->parent = curproc;
+  np->ustack = stack;
+  *np->tf = *curproc->tf;
+  np->tf->eip = (uint)fn;
+  np->tf->esp = sp;
+  np->cwd = idup(curproc->cwd);
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+
+  makerunnable(np);
+
+  release(&ptable.lock);
+
+  return pid;
+}
+
+// Create a new process running the program at path, as fork
+// followed by exec would, but without copying the caller's
+// address space.  If fdmap is not null, the child's fd i
+// is a duplicate of the caller's fd fdmap[i], or closed if
+// fdmap[i] < 0; otherwise the child gets all of the caller's
+// fds.  fdmap must be in kernel memory.  Returns the child's
+// pid, or -1 on error.
+int
+spawn(char *path, char **argv, int *fdmap)
+{
+  int i, fd, pid;
+  struct proc *np;
+  struct proc *curproc = myproc();
+
+  if(fdmap){
+    for(i = 0; i < NOFILE; i++){
+      fd = fdmap[i];
+      if(fd >= NOFILE || (fd >= 0 && curproc->fdt->ofile[fd] == 0))
+        return -1;
+    }
+  }
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+
+  memset(np->tf, 0, sizeof(*np->tf));
+  np->tf->cs = (SEG_UCODE << 3) | DPL_USER;
+  np->tf->ds = (SEG_UDATA << 3) | DPL_USER;
+  np->tf->es = np->tf->ds;
+  np->tf->ss = np->tf->ds;
+  np->tf->eflags = FL_IF;
+  allocspace(np);
+
+  if(loadimage(np, path, argv) < 0){
+    acquire(&ptable.lock);
+    np->fdt->ref = 0;
+    freeproc(np);
+    release(&ptable.lock);
+    return -1;
+  }
+
+  np->parent = curproc;
+  for(i = 0; i < NOFILE; i++){
+    fd = fdmap ? fdmap[i] : i;
+    if(fd >= 0 && curproc->fdt->ofile[fd])
+      np->fdt->ofile[i] = filedup(curproc->fdt->ofile[fd]);
+  }
+  np->cwd = idup(curproc->cwd);
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+
+  makerunnable(np);
+
+  release(&ptable.lock);
 
   return pid;
 }
@@ -276,31 +490,58 @@ fork(void)
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
+// Other threads sharing its address space keep running;
+// the last one to exit tears down the mappings and files.
 void
 exit(void)
 {
   struct proc *curproc = myproc();
+  struct vmspace *vm = curproc->vm;
+  struct fdtable *fdt = curproc->fdt;
   struct proc *p;
-  int fd;
+  int fd, lastvm, lastfdt;
 
-  // Remove mappings
-  for (int i = 0; i < curproc->num_mappings; i++) {
-    wunmap(curproc->mappings[i].addr);
+  acquire(&ptable.lock);
+  lastvm = --vm->nthreads == 0;
+  release(&ptable.lock);
+
+  // Remove mappings, writing back shared file-backed ones.
+  // wunmap() shifts the rest down, so always take the first.
+  // One it cannot write back stays, and its pages go with
+  // the page table.
+  if(lastvm){
+    while(vm->num_mappings > 0 && wunmap(vm->mappings[0].addr) == SUCCESS)
+      ;
   }
 
   if(curproc == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
-      curproc->ofile[fd] = 0;
+  // Close all open files.  The table stays allocated until
+  // they are closed, since wunmap() above may still use it.
+  acquire(&ptable.lock);
+  lastfdt = fdt->ref == 1;
+  if(!lastfdt)
+    fdt->ref--;
+  release(&ptable.lock);
+  if(lastfdt){
+    for(fd = 0; fd < NOFILE; fd++){
+      if(fdt->ofile[fd]){
+        fileclose(fdt->ofile[fd]);
+        fdt->ofile[fd] = 0;
+      }
     }
+    acquire(&ptable.lock);
+    fdt->ref = 0;
+    release(&ptable.lock);
   }
 
   begin_op();
   iput(curproc->cwd);
+  if(lastvm && vm->exe){
+    iput(vm->exe);
+    vm->exe = 0;
+  }
   end_op();
   curproc->cwd = 0;
 
@@ -326,6 +567,7 @@ exit(void)
 
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
+// Threads made by clone() are left to join().
 int
 wait(void)
 {
@@ -338,20 +580,13 @@ wait(void)
     // Scan through table looking for exited children.
     havekids = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
+      if(p->parent != curproc || p->vm == curproc->vm)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
+        freeproc(p);
         release(&ptable.lock);
         return pid;
       }
@@ -368,6 +603,285 @@ wait(void)
   }
 }
 
+// Wait for a thread made by this process's clone() calls to
+// exit, and return its pid.  If stack is not null, store the
+// user stack that was passed to clone() there.
+// Return -1 if this process has no threads.
+int
+join(void **stack)
+{
+  struct proc *p;
+  int havethreads, pid;
+  void *ustack;
+  struct proc *curproc = myproc();
+
+  acquire(&ptable.lock);
+  for(;;){
+    havethreads = 0;
+    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+      if(p->parent != curproc || p->vm != curproc->vm)
+        continue;
+      havethreads = 1;
+      if(p->state == ZOMBIE){
+        pid = p->pid;
+        ustack = p->ustack;
+        freeproc(p);
+        release(&ptable.lock);
+        if(stack)
+          *stack = ustack;
+        return pid;
+      }
+    }
+
+    if(!havethreads || curproc->killed){
+      release(&ptable.lock);
+      return -1;
+    }
+
+    sleep(curproc, &ptable.lock);
+  }
+}
+
+// Send a reschedule IPI to get c out of hlt.
+// Interrupts must be disabled.
+static void
+resched(struct cpu *c)
+{
+  if(c != mycpu())
+    lapicipi(c->apicid, T_RESCHED);
+}
+
+// May p run on c?
+static int
+allowed(struct proc *p, struct cpu *c)
+{
+  return (p->affinity & (1 << (c - cpus))) != 0;
+}
+
+// Record that p now belongs to c's run queue rather than the
+// one it last ran from.
+static void
+migrate(struct proc *p, struct cpu *c)
+{
+  p->cpu = c - cpus;
+  p->nmigrate++;
+  c->nmigrate++;
+}
+
+// Add runnable p to rq: at the tail of its level, or under
+// stride scheduling in pass order, after any equal passes.
+static void
+runqput(struct runq *rq, struct proc *p)
+{
+  struct proc **pp;
+  int l = p->level;
+
+  acquire(&rq->lock);
+  if(stridesched){
+    for(pp = &rq->head[0]; *pp; pp = &(*pp)->rnext)
+      if((int)((*pp)->pass - p->pass) > 0)
+        break;
+    p->rnext = *pp;
+    *pp = p;
+    if(p->rnext == 0)
+      rq->tail[0] = p;
+  } else {
+    p->rnext = 0;
+    if(rq->tail[l])
+      rq->tail[l]->rnext = p;
+    else
+      rq->head[l] = p;
+    rq->tail[l] = p;
+  }
+  rq->n++;
+  release(&rq->lock);
+}
+
+// Remove and return the first process on rq, at the highest
+// occupied level, that may run on c; or 0 if there is none.
+static struct proc*
+runqget(struct runq *rq, struct cpu *c)
+{
+  struct proc *p, *prev;
+  int l;
+
+  acquire(&rq->lock);
+  for(l = 0; l < NMLFQ; l++){
+    prev = 0;
+    for(p = rq->head[l]; p; prev = p, p = p->rnext)
+      if(allowed(p, c))
+        goto found;
+  }
+  release(&rq->lock);
+  return 0;
+
+found:
+  if(prev)
+    prev->rnext = p->rnext;
+  else
+    rq->head[l] = p->rnext;
+  if(rq->tail[l] == p)
+    rq->tail[l] = prev;
+  rq->n--;
+  release(&rq->lock);
+  return p;
+}
+
+// Mark p runnable and append it to the run queue of the cpu
+// it last ran on, to keep its cache warm, or of the least
+// loaded cpu its affinity allows if it may no longer run
+// there.  Caller must hold ptable.lock.
+static void
+makerunnable(struct proc *p)
+{
+  struct cpu *c, *v;
+
+  c = &cpus[p->cpu];
+  if(!allowed(p, c)){
+    c = 0;
+    for(v = cpus; v < &cpus[ncpu]; v++)
+      if(allowed(p, v) && (c == 0 || v->rq.n < c->rq.n))
+        c = v;
+    migrate(p, c);
+  }
+  p->state = RUNNABLE;
+  if(stridesched && (int)(p->pass - globalpass) < 0)
+    p->pass = globalpass;
+  runqput(&c->rq, p);
+
+  // If that cpu is halted, wake it.  If it is busy, wake some
+  // halted cpu to steal p instead -- unless p is only yielding,
+  // in which case its cpu will pick it straight back up.
+  if(c->idle)
+    resched(c);
+  else if(p != myproc()){
+    for(v = cpus; v < &cpus[ncpu]; v++){
+      if(v->idle && allowed(p, v)){
+        resched(v);
+        break;
+      }
+    }
+  }
+}
+
+// Does some level of v's run queue start with a process
+// that may run on c?  Read without locks.
+static int
+hasallowed(struct cpu *v, struct cpu *c)
+{
+  struct proc *h;
+  int l;
+
+  for(l = 0; l < NMLFQ; l++)
+    if((h = v->rq.head[l]) != 0 && allowed(h, c))
+      return 1;
+  return 0;
+}
+
+// Take a process from the longest run queue of another cpu
+// among those with one that may run here, the same test
+// canrun() makes, so that a queue of processes pinned
+// elsewhere does not hide one c could run.  The queues are
+// read without locks; a stale one only makes us pick a worse
+// victim or find its queue empty.
+static struct proc*
+steal(struct cpu *c)
+{
+  struct cpu *v, *busiest;
+  struct proc *p;
+
+  busiest = 0;
+  for(v = cpus; v < &cpus[ncpu]; v++){
+    if(v == c || v->rq.n == 0 || !hasallowed(v, c))
+      continue;
+    if(busiest == 0 || v->rq.n > busiest->rq.n)
+      busiest = v;
+  }
+  if(busiest == 0 || (p = runqget(&busiest->rq, c)) == 0)
+    return 0;
+  c->nsteal++;
+  return p;
+}
+
+// Take the process with the lowest pass among the heads of
+// all the run queues, looking at this cpu's first so that it
+// wins ties.  The heads are compared without locks; a stale
+// one costs at most one out-of-order dispatch.
+static struct proc*
+stridepick(struct cpu *c)
+{
+  struct cpu *v, *best;
+  struct proc *h;
+  uint pass;
+
+  best = 0;
+  pass = 0;
+  if((h = c->rq.head[0]) != 0){
+    best = c;
+    pass = h->pass;
+  }
+  for(v = cpus; v < &cpus[ncpu]; v++){
+    if(v == c || (h = v->rq.head[0]) == 0 || !allowed(h, c))
+      continue;
+    if(best == 0 || (int)(h->pass - pass) < 0){
+      best = v;
+      pass = h->pass;
+    }
+  }
+  if(best == 0 || (h = runqget(&best->rq, c)) == 0)
+    return 0;
+  if(best != c)
+    c->nsteal++;
+  return h;
+}
+
+// Choose the next process for c to run, or 0 if there is none.
+static struct proc*
+pick(struct cpu *c)
+{
+  struct proc *p;
+
+  if(stridesched)
+    return stridepick(c);
+  if((p = runqget(&c->rq, c)) == 0)
+    p = steal(c);
+  return p;
+}
+
+// Might c find something to run?  Other cpus' queues are
+// judged by the heads of their levels alone, without locks,
+// so that a process pinned elsewhere does not keep c spinning.
+static int
+canrun(struct cpu *c)
+{
+  struct cpu *v;
+
+  if(c->rq.n > 0)
+    return 1;
+  for(v = cpus; v < &cpus[ncpu]; v++)
+    if(v != c && hasallowed(v, c))
+      return 1;
+  return 0;
+}
+
+// Halt until an interrupt, unless some run queue has gained
+// a process since scheduler() last looked.  makerunnable()
+// queues first and then checks c->idle, and we set c->idle
+// first and then check the queues, so one of us sees the other.
+static void
+idle(struct cpu *c)
+{
+  cli();
+  c->idle = 1;
+  __sync_synchronize();
+  if(!canrun(c)){
+    c->nhalt++;
+    stihlt();
+  }
+  c->idle = 0;
+  sti();
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -387,28 +901,49 @@ scheduler(void)
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
+    // Take the next process from the run queues.  That needs
+    // only their locks, so an idle cpu stays off ptable.lock.
+    // A dequeued process stays RUNNABLE: nothing but a
+    // scheduler changes that state.
+    if((p = pick(c)) == 0){
+      idle(c);
+      continue;
+    }
+
+    if(ptable.lock.next != ptable.lock.serving)
+      c->nlockwait++;
     acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    do {
       if(p->state != RUNNABLE)
-        continue;
+        panic("scheduler");
 
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
       // before jumping back to us.
       c->proc = p;
+      if(p->cpu != c - cpus)
+        migrate(p, c);
       switchuvm(p);
       p->state = RUNNING;
+      p->nsched++;
+      c->nswtch++;
+      if((int)(p->pass - globalpass) > 0)
+        globalpass = p->pass;
 
       swtch(&(c->scheduler), p->context);
-      switchkvm();
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
+      // Its page table stays loaded, so that if the next process
+      // is another of its threads, switchuvm need not reload
+      // %cr3.  Holding ptable.lock keeps the page table alive.
       c->proc = 0;
+    } while((p = pick(c)) != 0);
+    if(c->upgdir){
+      switchkvm();
+      c->upgdir = 0;
     }
     release(&ptable.lock);
-
   }
 }
 
@@ -438,12 +973,133 @@ sched(void)
   mycpu()->intena = intena;
 }
 
+// Charge the current process for a clock tick.  Give up the
+// cpu if the process has used its time slice, dropping it a
+// level, or if a process at a higher level is waiting here.
+// The queue heads are read without the lock; a stale one just
+// decides on the next tick.
+void
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq = &mycpu()->rq;
+  int l;
+
+  p->runticks[p->level]++;
+  if(stridesched){
+    // Charge the tick and let the lowest pass run next.
+    acquire(&ptable.lock);
+    p->pass += p->stride;
+    makerunnable(p);
+    sched();
+    release(&ptable.lock);
+    return;
+  }
+
+  p->slice++;
+  for(l = 0; l < p->level; l++)
+    if(rq->head[l])
+      break;
+  if(p->slice < mlfqslice[p->level] && l == p->level)
+    return;
+
+  acquire(&ptable.lock);
+  if(p->slice >= mlfqslice[p->level]){
+    if(p->level < NMLFQ-1)
+      p->level++;
+    p->slice = 0;
+  }
+  makerunnable(p);
+  sched();
+  release(&ptable.lock);
+}
+
+// Move every process back to the top level, so that those
+// that have sunk to the bottom are not starved by a stream
+// of new or interactive ones.  Runs from the timer interrupt
+// every MLFQBOOST ticks.
+static void
+boost(void *unused)
+{
+  struct proc *p;
+  struct cpu *c;
+  struct runq *rq;
+  int l;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    p->level = 0;
+    p->slice = 0;
+  }
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    rq = &c->rq;
+    acquire(&rq->lock);
+    for(l = 1; l < NMLFQ; l++){
+      if(rq->head[l] == 0)
+        continue;
+      if(rq->tail[0])
+        rq->tail[0]->rnext = rq->head[l];
+      else
+        rq->head[0] = rq->head[l];
+      rq->tail[0] = rq->tail[l];
+      rq->head[l] = rq->tail[l] = 0;
+    }
+    release(&rq->lock);
+  }
+  release(&ptable.lock);
+  timerset(&boosttimer, ticks + MLFQBOOST, boost, 0);
+}
+
+// Even out the run queues: move half the difference between
+// the longest and the shortest to the shortest, taking only
+// processes allowed there.  Stealing already feeds idle cpus;
+// this catches cpus that are busy but have less waiting.
+// Runs from the timer interrupt every BALANCETICKS ticks.
+static void
+balance(void *unused)
+{
+  struct cpu *c, *from, *to;
+  struct proc *p;
+  int n;
+
+  from = to = &cpus[0];
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(c->rq.n > from->rq.n)
+      from = c;
+    if(c->rq.n < to->rq.n)
+      to = c;
+  }
+  for(n = (from->rq.n - to->rq.n) / 2; n > 0; n--){
+    if((p = runqget(&from->rq, to)) == 0)
+      break;
+    migrate(p, to);
+    runqput(&to->rq, p);
+  }
+  if(to->idle)
+    resched(to);
+  timerset(&balancetimer, ticks + BALANCETICKS, balance, 0);
+}
+
+// Start the periodic priority boost and load balancing.
+// Under stride scheduling every cpu already picks from all
+// the queues, so neither applies.
+void
+schedinit(void)
+{
+  if(stridesched)
+    return;
+  acquire(&tickslock);
+  timerset(&boosttimer, ticks + MLFQBOOST, boost, 0);
+  timerset(&balancetimer, ticks + BALANCETICKS, balance, 0);
+  release(&tickslock);
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  makerunnable(myproc());
   sched();
   release(&ptable.lock);
 }
@@ -469,12 +1125,37 @@ forkret(void)
   // Return to "caller", actually trapret (see allocproc).
 }
 
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+// Return the sleep queue for chan.  Channels are addresses,
+// so mix the bits before taking the bucket.
+static struct proc**
+sleepq(void *chan)
+{
+  return &ptable.sleepq[((uint)chan * 2654435761U >> 16) % NSLEEPQ];
+}
+
+// Take sleeping p off its sleep queue and make it runnable.
+// The ptable lock must be held.
+static void
+unsleep(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = sleepq(p->chan); *pp; pp = &(*pp)->snext){
+    if(*pp == p){
+      *pp = p->snext;
+      break;
+    }
+  }
+  makerunnable(p);
+}
+
+// Atomically release lock and sleep on chan, unless timer t
+// has already fired.  Reacquires lock when awakened.
+static void
+sleep1(void *chan, struct spinlock *lk, struct timer *t)
 {
   struct proc *p = myproc();
+  struct proc **q;
   
   if(p == 0)
     panic("sleep");
@@ -492,15 +1173,25 @@ sleep(void *chan, struct spinlock *lk)
     acquire(&ptable.lock);  //DOC: sleeplock1
     release(lk);
   }
+  // The timer fires with tickslock held and then takes
+  // ptable.lock to wake us, so checking it here cannot
+  // miss an expiry.
+  if(t && t->fired)
+    goto out;
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  q = sleepq(chan);
+  p->snext = *q;
+  *q = p;
 
   sched();
 
   // Tidy up.
   p->chan = 0;
 
+out:
   // Reacquire original lock.
   if(lk != &ptable.lock){  //DOC: sleeplock2
     release(&ptable.lock);
@@ -508,17 +1199,72 @@ sleep(void *chan, struct spinlock *lk)
   }
 }
 
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
+void
+sleep(void *chan, struct spinlock *lk)
+{
+  sleep1(chan, lk, 0);
+}
+
+struct sleeper {
+  struct timer t;
+  struct proc *p;
+  void *chan;
+};
+
+static void
+sleepexpire(void *arg)
+{
+  struct sleeper *s = arg;
+
+  wakeupproc(s->p, s->chan);
+}
+
+// Like sleep, but give up after n ticks.  Returns 1 if the
+// timeout expired and 0 if woken (or killed) before then.
+// lk must not be ptable.lock, which the timer needs.
+int
+sleeptimeout(void *chan, struct spinlock *lk, uint n)
+{
+  struct sleeper s;
+
+  if(lk == &ptable.lock)
+    panic("sleeptimeout");
+  s.p = myproc();
+  s.chan = chan;
+  if(lk != &tickslock)
+    acquire(&tickslock);
+  timerset(&s.t, ticks + n, sleepexpire, &s);
+  if(lk != &tickslock)
+    release(&tickslock);
+
+  sleep1(chan, lk, &s.t);
+
+  if(lk != &tickslock)
+    acquire(&tickslock);
+  timercancel(&s.t);
+  if(lk != &tickslock)
+    release(&tickslock);
+  return s.t.fired;
+}
+
 //PAGEBREAK!
 // Wake up all processes sleeping on chan.
 // The ptable lock must be held.
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  struct proc **pp, *p;
+
+  pp = sleepq(chan);
+  while((p = *pp) != 0){
+    if(p->chan == chan){
+      *pp = p->snext;
+      makerunnable(p);
+    } else
+      pp = &p->snext;
+  }
 }
 
 // Wake up all processes sleeping on chan.
@@ -530,6 +1276,17 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
+// Wake p if it is sleeping on chan.  For callers that keep
+// their own queues of sleepers and so need not search.
+void
+wakeupproc(struct proc *p, void *chan)
+{
+  acquire(&ptable.lock);
+  if(p->state == SLEEPING && p->chan == chan)
+    unsleep(p);
+  release(&ptable.lock);
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -544,7 +1301,7 @@ kill(int pid)
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+        unsleep(p);
       release(&ptable.lock);
       return 0;
     }
@@ -553,6 +1310,93 @@ kill(int pid)
   return -1;
 }
 
+// Report each cpu's scheduling counters.  The counters are
+// read without locks, so they are a snapshot at best.
+int
+getcpuinfo(struct cpuinfo *ci)
+{
+  struct cpu *c;
+  int i;
+
+  ci->ncpu = ncpu < MAX_CPU_INFO ? ncpu : MAX_CPU_INFO;
+  for(i = 0; i < ci->ncpu; i++){
+    c = &cpus[i];
+    ci->nswtch[i] = c->nswtch;
+    ci->nsteal[i] = c->nsteal;
+    ci->nlockwait[i] = c->nlockwait;
+    ci->nrunnable[i] = c->rq.n;
+    ci->nhalt[i] = c->nhalt;
+    ci->nresched[i] = c->nresched;
+    ci->nticks[i] = c->nticks;
+    ci->nidleticks[i] = c->nidleticks;
+    ci->nmigrate[i] = c->nmigrate;
+  }
+  return 0;
+}
+
+// Set the current process's share of the cpu under stride
+// scheduling.  Children inherit it.
+int
+settickets(int n)
+{
+  struct proc *p = myproc();
+
+  if(n < 1 || n > STRIDE1)
+    return -1;
+  acquire(&ptable.lock);
+  p->tickets = n;
+  p->stride = STRIDE1 / n;
+  release(&ptable.lock);
+  return 0;
+}
+
+// Restrict the current process to the cpus in mask, bit i
+// standing for cpus[i].  Children inherit the mask.  If the
+// process may no longer run where it is, move it now.
+int
+setaffinity(uint mask)
+{
+  struct proc *p = myproc();
+
+  mask &= (1 << ncpu) - 1;
+  if(mask == 0)
+    return -1;
+  acquire(&ptable.lock);
+  p->affinity = mask;
+  if(!allowed(p, &cpus[p->cpu])){
+    makerunnable(p);
+    sched();
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
+// Report each process's scheduling state.  Like procdump,
+// this reads without ptable.lock: pi is user memory, and the
+// page-fault handler must not run with that lock held.
+int
+getpinfo(struct pinfo *pi)
+{
+  struct proc *p;
+  int i;
+
+  for(i = 0; i < NPROC; i++){
+    p = &ptable.proc[i];
+    pi->inuse[i] = p->state != UNUSED;
+    pi->pid[i] = p->pid;
+    pi->level[i] = p->level;
+    memmove(pi->ticks[i], p->runticks, sizeof p->runticks);
+    pi->nsched[i] = p->nsched;
+    pi->tickets[i] = p->tickets;
+    pi->stride[i] = p->stride;
+    pi->pass[i] = p->pass;
+    pi->affinity[i] = p->affinity;
+    pi->nmigrate[i] = p->nmigrate;
+    pi->cpu[i] = p->cpu;
+  }
+  return 0;
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -2,6 +2,7 @@
 #define PROC_H
 #include "param.h"
 #include "wmap.h"
+#include "spinlock.h"
 // Per-CPU state
 struct cpu {
   uchar apicid;                // Local APIC ID
@@ -11,12 +12,52 @@ struct cpu {
   volatile uint started;       // Has the CPU started?
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
-  struct proc *proc;           // The process running on this cpu or null
+  struct cpu *cpu;             // This cpu, at %gs:0
+  struct proc *proc;           // The process running on this cpu or null, at %gs:4
+  pde_t *upgdir;               // User page table in %cr3, or 0 for kpgdir
+  volatile uint tlbpend;       // CPUs (bit i for cpus[i]) awaiting a TLB flush here
+  struct runq {
+    struct spinlock lock;
+    struct proc *head[NMLFQ];  // Oldest runnable process at each level, linked by rnext
+    struct proc *tail[NMLFQ];
+    int n;                     // Number of processes queued
+  } rq;                        // Processes waiting to run on this cpu
+  uint nswtch;                 // Processes switched to
+  uint nsteal;                 // Processes stolen from other cpus' queues
+  uint nlockwait;              // Times scheduler found ptable.lock held
+  volatile int idle;           // About to halt or halted in scheduler()
+  uint nhalt;                  // Times halted for want of work
+  uint nresched;               // Reschedule IPIs received
+  uint nticks;                 // Timer interrupts taken
+  uint nidleticks;             // Of those, ones with no process running
+  uint nmigrate;               // Processes moved here from another cpu
 };
 
 extern struct cpu cpus[NCPU];
 extern int ncpu;
 
+// Per-cpu variables are read through %gs, which seginit()
+// points at cpu->cpu on each cpu, so each is a single load.
+// myproc() therefore needs no pushcli; mycpu() is stable only
+// while interrupts are disabled, as the caller may be moved.
+static inline struct cpu*
+mycpu(void)
+{
+  struct cpu *c;
+
+  asm volatile("movl %%gs:0, %0" : "=r" (c));
+  return c;
+}
+
+static inline struct proc*
+myproc(void)
+{
+  struct proc *p;
+
+  asm volatile("movl %%gs:4, %0" : "=r" (p));
+  return p;
+}
+
 //PAGEBREAK: 17
 // Saved registers for kernel context switches.
 // Don't need to save all the segment registers (%cs, etc),
@@ -44,12 +85,42 @@ struct mapping {
   int num_pages_loaded;
 };
 
+// A loadable ELF segment of the running executable, recorded by
+// exec() so that handle_pagefault() can load its pages on demand.
+struct segment {
+  uint vaddr;   // page-aligned start address
+  uint memsz;   // size in memory
+  uint off;     // file offset of the segment
+  uint filesz;  // bytes backed by the file; the rest is zero-filled
+};
+
+// Address space, shared by a process and the threads it
+// creates with clone().
+struct vmspace {
+  struct spinlock lock;        // Protects the page table and the fields below
+  int ref;                     // Processes, including zombies, using it
+  int nthreads;                // Processes using it that have not exited
+  uint sz;                     // Size of process memory (bytes)
+  pde_t* pgdir;                // Page table
+  struct mapping mappings[MAX_WMMAP_INFO];
+  int num_mappings;
+  struct inode *exe;           // Executable backing demand-loaded pages
+  struct segment segs[MAXLOADSEG]; // Loadable segments of exe
+  int nsegs;
+};
+
+// Open file table, shared like the address space.
+struct fdtable {
+  struct spinlock lock;        // Protects ofile slots during allocation
+  int ref;                     // Processes using it that have not exited
+  struct file *ofile[NOFILE];  // Open files
+};
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
 struct proc {
-  uint sz;                     // Size of process memory (bytes)
-  pde_t* pgdir;                // Page table
+  struct vmspace *vm;          // Address space
   char *kstack;                // Bottom of kernel stack for this process
   enum procstate state;        // Process state
   int pid;                     // Process ID
@@ -58,11 +129,24 @@ struct proc {
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
+  struct fdtable *fdt;         // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
-  struct mapping mappings[MAX_WMMAP_INFO];
-  int num_mappings;
+  void *ustack;                // User stack given to clone(), for join()
+  struct proc *snext;          // Next sleeper in chan's sleep queue
+  uint fkey;                   // If non-zero, waiting in futex_wait() on this key
+  struct proc *fnext;          // Next waiter in the futex queue
+  int cpu;                     // Index in cpus[] of the cpu p last ran on
+  struct proc *rnext;          // Next process in that cpu's run queue
+  int level;                   // Scheduling priority level, 0 highest
+  int slice;                   // Ticks used of the time slice at level
+  uint runticks[NMLFQ];        // Ticks run at each level
+  uint nsched;                 // Times scheduled
+  int tickets;                 // Share of the cpu under stride scheduling
+  uint stride;                 // STRIDE1 / tickets
+  uint pass;                   // Virtual time; lowest pass runs next
+  uint affinity;               // Cpus p may run on, bit i for cpus[i]
+  uint nmigrate;               // Times moved to another cpu
 };
 
 // Process memory is laid out contiguously, low addresses first:
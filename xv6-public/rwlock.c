@@ -0,0 +1,144 @@
+// Reader-writer locks.
+//
+// Like mutexes, a waiter spins while a writer holds the lock
+// and is running on another CPU, and otherwise sleeps.  Readers
+// cannot be watched that way, so waiting out readers always
+// sleeps.  Once a writer is waiting, new readers wait too, so
+// a stream of readers cannot starve writers; a process must
+// therefore not take a read lock it already holds.
+//
+// The profiler sees waits in both modes but holds only for
+// writers, since concurrent readers have no one acquire time.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "rwlock.h"
+
+void
+initrwlock(struct rwlock *rw, char *name)
+{
+  initlock(&rw->lk, "rwlock");
+  rw->name = name;
+  rw->readers = 0;
+  rw->writer = 0;
+  rw->wwait = 0;
+  rw->nsleep = 0;
+  rw->stat = lockclass(name, 1);
+}
+
+// Wait for a change while rw->lk is held: spin if the writer
+// is running elsewhere, else sleep until woken.
+static void
+rwwait(struct rwlock *rw)
+{
+  struct proc *o;
+
+  if((o = rw->writer) != 0 && o->state == RUNNING){
+    // As in acquiremutex(): proc structs are never freed.
+    release(&rw->lk);
+    while(*(struct proc* volatile*)&rw->writer == o &&
+          *(volatile enum procstate*)&o->state == RUNNING)
+      pause();
+    acquire(&rw->lk);
+    return;
+  }
+  rw->nsleep++;
+  sleep(rw, &rw->lk);
+  rw->nsleep--;
+}
+
+void
+acquireread(struct rwlock *rw)
+{
+  uint64 t;
+  int waited;
+
+  waited = 0;
+  t = rdtsc();
+  acquire(&rw->lk);
+  while(rw->writer || rw->wwait){
+    if(rw->writer == myproc())
+      panic("acquireread");
+    waited = 1;
+    rwwait(rw);
+  }
+  rw->readers++;
+  if(waited)
+    lockwaited(rw->stat, rdtsc() - t, (uint)__builtin_return_address(0));
+  release(&rw->lk);
+}
+
+void
+acquirewrite(struct rwlock *rw)
+{
+  uint64 t;
+  int waited;
+
+  waited = 0;
+  t = rdtsc();
+  acquire(&rw->lk);
+  if(rw->writer || rw->readers){
+    if(rw->writer == myproc())
+      panic("acquirewrite");
+    waited = 1;
+    rw->wwait++;
+    while(rw->writer || rw->readers)
+      rwwait(rw);
+    rw->wwait--;
+  }
+  rw->writer = myproc();
+  if(waited)
+    lockwaited(rw->stat, rdtsc() - t, (uint)__builtin_return_address(0));
+  rw->tacquire = rdtsc();
+  release(&rw->lk);
+}
+
+// Release rw, held in either mode.
+void
+releaserw(struct rwlock *rw)
+{
+  acquire(&rw->lk);
+  if(rw->writer == myproc()){
+    lockheld(rw->stat, rdtsc() - rw->tacquire);
+    rw->writer = 0;
+  } else if(rw->readers > 0)
+    rw->readers--;
+  else
+    panic("releaserw");
+  // Skip the wakeup, and the ptable.lock and sleep-queue
+  // walk it costs, unless someone is asleep and could now
+  // get in.
+  if(rw->nsleep && rw->readers == 0)
+    wakeup(rw);
+  release(&rw->lk);
+}
+
+// Turn the caller's write lock into a read lock, letting
+// other readers in without anyone else writing meanwhile.
+void
+downgraderw(struct rwlock *rw)
+{
+  acquire(&rw->lk);
+  if(rw->writer != myproc())
+    panic("downgraderw");
+  lockheld(rw->stat, rdtsc() - rw->tacquire);
+  rw->writer = 0;
+  rw->readers++;
+  if(rw->nsleep)
+    wakeup(rw);
+  release(&rw->lk);
+}
+
+// Is rw held to write by the caller, or held by any reader?
+// Readers are not recorded, so this cannot tell whose it is.
+int
+holdingrw(struct rwlock *rw)
+{
+  return rw->writer == myproc() || rw->readers > 0;
+}
@@ -0,0 +1,19 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+#include "spinlock.h"
+// Reader-writer locks for processes: any number of readers
+// or one writer.
+struct rwlock {
+  int readers;                 // Number of readers holding the lock
+  struct proc *writer;         // Process holding it to write, or 0
+  int wwait;                   // Writers waiting; new readers wait behind them
+  int nsleep;                  // Processes asleep on the lock
+  struct spinlock lk;          // spinlock protecting this lock
+
+  // For debugging:
+  char *name;                  // Name of lock.
+  struct lockstat *stat;       // Profile of this lock's class; see lockprof.c
+  uint64 tacquire;             // When the writer got the lock, from rdtsc
+};
+
+#endif
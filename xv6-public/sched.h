@@ -0,0 +1,36 @@
+#ifndef SCHED_H
+#define SCHED_H
+#include "types.h"
+#include "param.h"
+
+// for `getcpuinfo`
+#define MAX_CPU_INFO 8
+struct cpuinfo {
+    int ncpu;                        // Number of CPUs reported
+    uint nswtch[MAX_CPU_INFO];       // Processes the CPU has switched to
+    uint nsteal[MAX_CPU_INFO];       // Processes taken from other CPUs' run queues
+    uint nlockwait[MAX_CPU_INFO];    // Times the scheduler found ptable.lock held
+    int nrunnable[MAX_CPU_INFO];     // Processes waiting in the CPU's run queue
+    uint nhalt[MAX_CPU_INFO];        // Times the CPU halted for want of work
+    uint nresched[MAX_CPU_INFO];     // Reschedule IPIs the CPU received
+    uint nticks[MAX_CPU_INFO];       // Timer interrupts the CPU took
+    uint nidleticks[MAX_CPU_INFO];   // Of those, ones with no process running
+    uint nmigrate[MAX_CPU_INFO];     // Processes moved to the CPU from another
+};
+
+// for `getpinfo`
+struct pinfo {
+    int inuse[NPROC];                // Whether the slot holds a process
+    int pid[NPROC];                  // Process ID
+    int level[NPROC];                // Current priority level, 0 highest
+    uint ticks[NPROC][NMLFQ];        // Ticks run at each level
+    uint nsched[NPROC];              // Times scheduled
+    int tickets[NPROC];              // Share of the CPU under stride scheduling
+    uint stride[NPROC];              // STRIDE1 / tickets
+    uint pass[NPROC];                // Stride scheduling virtual time
+    uint affinity[NPROC];            // CPUs allowed, bit i for CPU i
+    uint nmigrate[NPROC];            // Times moved to another CPU
+    int cpu[NPROC];                  // CPU last run on
+};
+
+#endif
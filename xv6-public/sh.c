@@ -3,6 +3,7 @@
 #include "types.h"
 #include "user.h"
 #include "fcntl.h"
+#include "param.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -52,6 +53,24 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int spawnable(struct cmd*);
+int spawncmd(struct cmd*, int*);
+void freecmd(struct cmd*);
+
+// The shell's own descriptors, as handed to spawned commands:
+// 0, 1 and 2, the rest -1 (filled in by main).
+int stdfds[NOFILE];
+
+// Run cmd in children and wait for all of them.
+void
+spawnwait(struct cmd *cmd)
+{
+  int n;
+
+  n = spawncmd(cmd, stdfds);
+  while(n-- > 0)
+    wait();
+}
 
 // Execute cmd.  Never returns.
 void
@@ -91,9 +110,13 @@ runcmd(struct cmd *cmd)
 
   case LIST:
     lcmd = (struct listcmd*)cmd;
-    if(fork1() == 0)
-      runcmd(lcmd->left);
-    wait();
+    if(spawnable(lcmd->left))
+      spawnwait(lcmd->left);
+    else {
+      if(fork1() == 0)
+        runcmd(lcmd->left);
+      wait();
+    }
     runcmd(lcmd->right);
     break;
 
@@ -123,13 +146,89 @@ runcmd(struct cmd *cmd)
 
   case BACK:
     bcmd = (struct backcmd*)cmd;
-    if(fork1() == 0)
+    if(spawnable(bcmd->cmd))
+      spawncmd(bcmd->cmd, stdfds);
+    else if(fork1() == 0)
       runcmd(bcmd->cmd);
     break;
   }
   exit();
 }
 
+// Can cmd run with spawn() alone, without a copy of the shell?
+// True for commands built only from execs, redirections and
+// pipes, which is most of what people type.
+int
+spawnable(struct cmd *cmd)
+{
+  struct pipecmd *pcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    return 1;
+  case REDIR:
+    return spawnable(((struct redircmd*)cmd)->cmd);
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    return spawnable(pcmd->left) && spawnable(pcmd->right);
+  }
+  return 0;
+}
+
+// Start the programs of spawnable cmd, with fd i of each
+// bound to the shell's fd fdmap[i] unless cmd redirects it.
+// Returns the number of children started.
+int
+spawncmd(struct cmd *cmd, int *fdmap)
+{
+  int p[2], fd, n, map[NOFILE];
+  struct execcmd *ecmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch(cmd->type){
+  default:
+    panic("spawncmd");
+
+  case EXEC:
+    ecmd = (struct execcmd*)cmd;
+    if(ecmd->argv[0] == 0)
+      return 0;
+    if(spawn(ecmd->argv[0], ecmd->argv, fdmap) < 0){
+      printf(2, "exec %s failed\n", ecmd->argv[0]);
+      return 0;
+    }
+    return 1;
+
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    if((fd = open(rcmd->file, rcmd->mode)) < 0){
+      printf(2, "open %s failed\n", rcmd->file);
+      return 0;
+    }
+    memmove(map, fdmap, sizeof(map));
+    map[rcmd->fd] = fd;
+    n = spawncmd(rcmd->cmd, map);
+    close(fd);
+    return n;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0)
+      panic("pipe");
+    memmove(map, fdmap, sizeof(map));
+    map[1] = p[1];
+    n = spawncmd(pcmd->left, map);
+    memmove(map, fdmap, sizeof(map));
+    map[0] = p[0];
+    n += spawncmd(pcmd->right, map);
+    close(p[0]);
+    close(p[1]);
+    return n;
+  }
+  return 0;
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -146,6 +245,7 @@ main(void)
 {
   static char buf[100];
   int fd;
+  struct cmd *cmd;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -154,6 +254,8 @@ main(void)
       break;
     }
   }
+  for(fd = 0; fd < NOFILE; fd++)
+    stdfds[fd] = fd < 3 ? fd : -1;
 
   // Read and run input commands.
   while(getcmd(buf, sizeof(buf)) >= 0){
@@ -164,9 +266,16 @@ main(void)
         printf(2, "cannot cd %s\n", buf+3);
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait();
+    if((cmd = parsecmd(buf)) == 0)
+      continue;
+    if(spawnable(cmd))
+      spawnwait(cmd);
+    else {
+      if(fork1() == 0)
+        runcmd(cmd);
+      wait();
+    }
+    freecmd(cmd);
   }
   exit();
 }
@@ -324,18 +433,35 @@ struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
 struct cmd *nulterminate(struct cmd*);
 
+// The shell parses commands itself, so a syntax error must
+// not exit; it is recorded here and parsecmd() returns 0.
+int parseerr;
+
+void
+syntax(char *s)
+{
+  if(!parseerr)
+    printf(2, "%s\n", s);
+  parseerr = 1;
+}
+
 struct cmd*
 parsecmd(char *s)
 {
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     printf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -379,8 +505,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -405,8 +533,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -431,13 +561,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc+1 >= MAXARGS){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -491,3 +625,41 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Free a parsed command tree.
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
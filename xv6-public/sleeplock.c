@@ -17,17 +17,25 @@ initsleeplock(struct sleeplock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
+  lk->stat = lockclass(name, 1);
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+  uint64 t;
+
+  t = rdtsc();
   acquire(&lk->lk);
-  while (lk->locked) {
-    sleep(lk, &lk->lk);
+  if(lk->locked){
+    while (lk->locked) {
+      sleep(lk, &lk->lk);
+    }
+    lockwaited(lk->stat, rdtsc() - t, (uint)__builtin_return_address(0));
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->tacquire = rdtsc();
   release(&lk->lk);
 }
 
@@ -35,6 +43,7 @@ void
 releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
+  lockheld(lk->stat, rdtsc() - lk->tacquire);
   lk->locked = 0;
   lk->pid = 0;
   wakeup(lk);
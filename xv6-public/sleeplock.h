@@ -9,6 +9,8 @@ struct sleeplock {
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+  struct lockstat *stat; // Profile of this lock's class; see lockprof.c
+  uint64 tacquire;   // When the holder got the lock, from rdtsc
 };
 
 #endif
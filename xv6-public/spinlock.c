@@ -13,8 +13,13 @@ void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->next = 0;
+  lk->serving = 0;
   lk->cpu = 0;
+  lk->nacquire = 0;
+  lk->ncontended = 0;
+  lk->spincycles = 0;
+  lk->stat = lockclass(name, 0);
 }
 
 // Acquire the lock.
@@ -24,22 +29,48 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint ticket, serving;
+  uint64 t, now;
+  int i;
+
   pushcli(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+  // Take a ticket; the locked xadd is atomic.
+  ticket = __sync_fetch_and_add(&lk->next, 1);
+  if(ticket != lk->serving){
+    t = rdtsc();
+    while((serving = lk->serving) != ticket){
+      // Interrupts are off while spinning, so answer TLB
+      // shootdowns here; the holder may be waiting for one.
+      tlbpoll();
+      // Back off in proportion to our place in line, so that
+      // waiters further back keep off the lock's cache line.
+      for(i = (ticket - serving - 1) * 32; i > 0; i--)
+        pause();
+    }
+    now = rdtsc();
+    lk->ncontended++;
+    lk->spincycles += now - t;
+    if(lk->stat)
+      lockwaited(lk->stat, now - t, (uint)__builtin_return_address(0));
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
   // references happen after the lock is acquired.
   __sync_synchronize();
 
+  lk->nacquire++;
+  if(lk->stat)
+    lk->tacquire = rdtsc();
+
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
+#ifdef LOCKDEBUG
   getcallerpcs(&lk, lk->pcs);
+#endif
 }
 
 // Release the lock.
@@ -49,7 +80,12 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+  if(lk->stat)
+    lockheld(lk->stat, rdtsc() - lk->tacquire);
+
+#ifdef LOCKDEBUG
   lk->pcs[0] = 0;
+#endif
   lk->cpu = 0;
 
   // Tell the C compiler and the processor to not move loads or stores
@@ -59,10 +95,9 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  // Serve the next ticket.  Only the holder writes serving,
+  // so a plain (aligned, hence atomic) store will do.
+  lk->serving = lk->serving + 1;
 
   popcli();
 }
@@ -91,7 +126,7 @@ holding(struct spinlock *lock)
 {
   int r;
   pushcli();
-  r = lock->locked && lock->cpu == mycpu();
+  r = lock->next != lock->serving && lock->cpu == mycpu();
   popcli();
   return r;
 }
@@ -124,3 +159,23 @@ popcli(void)
     sti();
 }
 
+// A lock of its own for lockbench(), so that concurrent runs
+// contend with each other and nothing else.  Never passed to
+// initlock(), it has no class and is not profiled.
+static struct spinlock benchlock = { .name = "bench" };
+
+// Time n acquire/release pairs, for the lockbench program.
+// Returns the elapsed cycles.
+uint
+lockbench(int n)
+{
+  uint64 t;
+  int i;
+
+  t = rdtsc();
+  for(i = 0; i < n; i++){
+    acquire(&benchlock);
+    release(&benchlock);
+  }
+  return rdtsc() - t;
+}
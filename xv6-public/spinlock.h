@@ -1,14 +1,26 @@
 #ifndef SPINLOCK_H
 #define SPINLOCK_H
-// Mutual exclusion lock.
+struct lockstat;
+
+// Mutual exclusion lock.  A ticket lock: each acquirer takes
+// the next ticket and waits until it is being served, so the
+// lock is granted in arrival order.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  volatile uint next;    // Next ticket to hand out
+  volatile uint serving; // Ticket that holds the lock
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uint pcs[10];      // The call stack (an array of program counters)
-                     // that locked the lock.
+                     // that locked the lock; only with LOCKDEBUG.
+
+  // Statistics, updated by the holder:
+  uint nacquire;     // Times acquired
+  uint ncontended;   // Times an acquirer had to wait
+  uint64 spincycles; // Cycles spent waiting, from rdtsc
+  struct lockstat *stat; // Profile of this lock's class; see lockprof.c
+  uint64 tacquire;   // When the holder got the lock, from rdtsc
 };
 
 #endif
@@ -19,7 +19,7 @@ fetchint(uint addr, int *ip)
 {
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz || addr+4 > curproc->sz)
+  if(addr >= curproc->vm->sz || addr+4 > curproc->vm->sz)
     return -1;
   *ip = *(int*)(addr);
   return 0;
@@ -34,10 +34,10 @@ fetchstr(uint addr, char **pp)
   char *s, *ep;
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  if(addr >= curproc->vm->sz)
     return -1;
   *pp = (char*)addr;
-  ep = (char*)curproc->sz;
+  ep = (char*)curproc->vm->sz;
   for(s = *pp; s < ep; s++){
     if(*s == 0)
       return s - *pp;
@@ -59,12 +59,17 @@ int
 argptr(int n, char **pp, int size)
 {
   int i;
+  uint a;
   struct proc *curproc = myproc();
  
   if(argint(n, &i) < 0)
     return -1;
-  if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
+  if(size < 0 || (uint)i >= curproc->vm->sz || (uint)i+size > curproc->vm->sz)
     return -1;
+  // Fault in lazily loaded pages now, before the caller takes
+  // locks that the page-fault handler could not sleep under.
+  for(a = PGROUNDDOWN((uint)i); a < (uint)i+size; a += PGSIZE)
+    (void)*(volatile char*)a;
   *pp = (char*)i;
   return 0;
 }
@@ -108,6 +113,20 @@ extern int sys_wunmap(void);
 extern int sys_wremap(void);
 extern int sys_getpgdirinfo(void);
 extern int sys_getwmapinfo(void);
+extern int sys_spawn(void);
+extern int sys_clone(void);
+extern int sys_join(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_getcpuinfo(void);
+extern int sys_getpinfo(void);
+extern int sys_settickets(void);
+extern int sys_setaffinity(void);
+extern int sys_lockbench(void);
+extern int sys_getlockstat(void);
+extern int sys_getbcachestat(void);
+extern int sys_setbcachemax(void);
+extern int sys_getidestat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -136,6 +155,20 @@ static int (*syscalls[])(void) = {
 [SYS_wremap]  sys_wremap,
 [SYS_getpgdirinfo] sys_getpgdirinfo,
 [SYS_getwmapinfo] sys_getwmapinfo,
+[SYS_spawn]   sys_spawn,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_getcpuinfo] sys_getcpuinfo,
+[SYS_getpinfo] sys_getpinfo,
+[SYS_settickets] sys_settickets,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_lockbench] sys_lockbench,
+[SYS_getlockstat] sys_getlockstat,
+[SYS_getbcachestat] sys_getbcachestat,
+[SYS_setbcachemax] sys_setbcachemax,
+[SYS_getidestat] sys_getidestat,
 };
 
 void
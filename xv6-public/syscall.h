@@ -25,3 +25,17 @@
 #define SYS_wremap 24
 #define SYS_getpgdirinfo 25
 #define SYS_getwmapinfo 26
+#define SYS_spawn 27
+#define SYS_clone 28
+#define SYS_join  29
+#define SYS_futex_wait 30
+#define SYS_futex_wake 31
+#define SYS_getcpuinfo 32
+#define SYS_getpinfo 33
+#define SYS_settickets 34
+#define SYS_setaffinity 35
+#define SYS_lockbench 36
+#define SYS_getlockstat 37
+#define SYS_getbcachestat 38
+#define SYS_setbcachemax 39
+#define SYS_getidestat 40
@@ -26,7 +26,7 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE || (f=myproc()->fdt->ofile[fd]) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -41,14 +41,18 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *curproc = myproc();
+  struct fdtable *fdt = myproc()->fdt;
 
+  // Threads share fdt, so claim the slot under its lock.
+  acquire(&fdt->lock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd] == 0){
-      curproc->ofile[fd] = f;
+    if(fdt->ofile[fd] == 0){
+      fdt->ofile[fd] = f;
+      release(&fdt->lock);
       return fd;
     }
   }
+  release(&fdt->lock);
   return -1;
 }
 
@@ -95,10 +99,18 @@ sys_close(void)
 {
   int fd;
   struct file *f;
+  struct fdtable *fdt = myproc()->fdt;
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  // Another thread may be closing fd too; only one of us wins.
+  acquire(&fdt->lock);
+  if(fdt->ofile[fd] != f){
+    release(&fdt->lock);
+    return -1;
+  }
+  fdt->ofile[fd] = 0;
+  release(&fdt->lock);
   fileclose(f);
   return 0;
 }
@@ -393,19 +405,17 @@ sys_chdir(void)
   return 0;
 }
 
-int
-sys_exec(void)
+// Fetch the null-terminated argument vector at user address
+// uargv into argv, which has room for MAXARG entries.
+static int
+fetchargv(uint uargv, char **argv)
 {
-  char *path, *argv[MAXARG];
   int i;
-  uint uargv, uarg;
+  uint uarg;
 
-  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(argv[0]));
   for(i=0;; i++){
-    if(i >= NELEM(argv))
+    if(i >= MAXARG)
       return -1;
     if(fetchint(uargv+4*i, (int*)&uarg) < 0)
       return -1;
@@ -416,9 +426,51 @@ sys_exec(void)
     if(fetchstr(uarg, &argv[i]) < 0)
       return -1;
   }
+  return 0;
+}
+
+int
+sys_exec(void)
+{
+  char *path, *argv[MAXARG];
+  uint uargv;
+
+  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0){
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
   return exec(path, argv);
 }
 
+// Create a child running path with arguments argv, without
+// copying the caller's address space.  fdmap, if not null,
+// holds NOFILE entries: the child's fd i is a duplicate of
+// the caller's fd fdmap[i], or closed if fdmap[i] < 0.
+// A null fdmap gives the child all of the caller's fds.
+int
+sys_spawn(void)
+{
+  char *path, *argv[MAXARG];
+  uint uargv, ufdmap;
+  int *ufd, fdmap[NOFILE];
+
+  if(argstr(0, &path) < 0 || argint(1, (int*)&uargv) < 0 ||
+     argint(2, (int*)&ufdmap) < 0)
+    return -1;
+  // Copy the map in: spawn() checks it and then uses it after
+  // loading the program, and another thread could change the
+  // user's copy in between.
+  if(ufdmap){
+    if(argptr(2, (void*)&ufd, sizeof(fdmap)) < 0)
+      return -1;
+    memmove(fdmap, ufd, sizeof(fdmap));
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+  return spawn(path, argv, ufdmap ? fdmap : 0);
+}
+
 int
 sys_pipe(void)
 {
@@ -433,7 +485,7 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      myproc()->ofile[fd0] = 0;
+      myproc()->fdt->ofile[fd0] = 0;
     fileclose(rf);
     fileclose(wf);
     return -1;
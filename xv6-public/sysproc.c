@@ -7,6 +7,10 @@
 #include "mmu.h"
 #include "proc.h"
 #include "wmap.h"
+#include "sched.h"
+#include "lockstat.h"
+#include "bcache.h"
+#include "idestat.h"
 int
 sys_fork(void)
 {
@@ -36,6 +40,54 @@ sys_kill(void)
   return kill(pid);
 }
 
+int
+sys_clone(void)
+{
+  int fn, arg;
+  char *stack;
+
+  if(argint(0, &fn) < 0 || argint(1, &arg) < 0 ||
+     argptr(2, &stack, PGSIZE) < 0)
+    return -1;
+  return clone((void(*)(void*))fn, (void*)arg, stack);
+}
+
+int
+sys_join(void)
+{
+  int stack;
+  void **ustack;
+
+  if(argint(0, &stack) < 0)
+    return -1;
+  ustack = 0;
+  if(stack && argptr(0, (void*)&ustack, sizeof(*ustack)) < 0)
+    return -1;
+  return join(ustack);
+}
+
+int
+sys_futex_wait(void)
+{
+  int addr, val;
+
+  // Not argptr: wmap regions lie above vm->sz.  futex_wait()
+  // checks the address against the page table itself.
+  if(argint(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait((uint)addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  int addr, n;
+
+  if(argint(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake((uint)addr, n);
+}
+
 int
 sys_getpid(void)
 {
@@ -50,7 +102,7 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
+  addr = myproc()->vm->sz;
   if(growproc(n) < 0)
     return -1;
   return addr;
@@ -71,7 +123,9 @@ sys_sleep(void)
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    // Nothing else sleeps on ticks0, so only the timer and
+    // kill() wake us.
+    sleeptimeout(&ticks0, &tickslock, n - (ticks - ticks0));
   }
   release(&tickslock);
   return 0;
@@ -140,3 +194,98 @@ int sys_getwmapinfo(void)
   }
   return getwmapinfo(wminfo);
 }
+
+int
+sys_getcpuinfo(void)
+{
+  struct cpuinfo *ci;
+
+  if(argptr(0, (void*)&ci, sizeof(*ci)) < 0)
+    return -1;
+  return getcpuinfo(ci);
+}
+
+int
+sys_getpinfo(void)
+{
+  struct pinfo *pi;
+
+  if(argptr(0, (void*)&pi, sizeof(*pi)) < 0)
+    return -1;
+  return getpinfo(pi);
+}
+
+int
+sys_settickets(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return settickets(n);
+}
+
+int
+sys_setaffinity(void)
+{
+  int mask;
+
+  if(argint(0, &mask) < 0)
+    return -1;
+  return setaffinity((uint)mask);
+}
+
+int
+sys_lockbench(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0 || n < 1 || n > 1000000)
+    return -1;
+  return lockbench(n);
+}
+
+int
+sys_getlockstat(void)
+{
+  struct lockstat *ls;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0 || n > NLOCKCLASS)
+    return -1;
+  if(argptr(0, (void*)&ls, n*sizeof(*ls)) < 0)
+    return -1;
+  return getlockstat(ls, n);
+}
+
+int
+sys_getbcachestat(void)
+{
+  struct bcachestat *st;
+
+  if(argptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  getbcachestat(st);
+  return 0;
+}
+
+int
+sys_setbcachemax(void)
+{
+  int max;
+
+  if(argint(0, &max) < 0)
+    return -1;
+  return setbcachemax(max);
+}
+
+int
+sys_getidestat(void)
+{
+  struct idestat *st;
+
+  if(argptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  getidestat(st);
+  return 0;
+}
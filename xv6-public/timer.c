@@ -0,0 +1,116 @@
+// Kernel timers.
+//
+// Pending timers are kept in a binary min-heap ordered by
+// deadline, so the timer interrupt only looks at timers that
+// are due instead of waking every sleeper on every tick.
+// The heap is protected by tickslock; callbacks run from the
+// timer interrupt on CPU 0 with tickslock held, and may take
+// ptable.lock but nothing that is held while taking tickslock.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "timer.h"
+
+struct {
+  struct timer *heap[NTIMER];
+  int n;
+} timers;
+
+// Is timer a due before timer b?  Compare by difference so
+// that the tick counter may wrap.
+static int
+before(struct timer *a, struct timer *b)
+{
+  return (int)(a->when - b->when) < 0;
+}
+
+static void
+place(int i, struct timer *t)
+{
+  timers.heap[i] = t;
+  t->slot = i;
+}
+
+// Move the timer at slot i up or down to restore heap order.
+static void
+fix(int i)
+{
+  struct timer *t = timers.heap[i];
+  int c;
+
+  while(i > 0 && before(t, timers.heap[(i-1)/2])){
+    place(i, timers.heap[(i-1)/2]);
+    i = (i-1)/2;
+  }
+  for(;;){
+    c = 2*i + 1;
+    if(c >= timers.n)
+      break;
+    if(c+1 < timers.n && before(timers.heap[c+1], timers.heap[c]))
+      c++;
+    if(!before(timers.heap[c], t))
+      break;
+    place(i, timers.heap[c]);
+    i = c;
+  }
+  place(i, t);
+}
+
+static void
+removeslot(int i)
+{
+  struct timer *t = timers.heap[i];
+
+  timers.n--;
+  if(i < timers.n){
+    place(i, timers.heap[timers.n]);
+    fix(i);
+  }
+  t->slot = -1;
+}
+
+// Arrange for fn(arg) to be called at tick when.
+// Caller must hold tickslock.
+void
+timerset(struct timer *t, uint when, void (*fn)(void*), void *arg)
+{
+  if(!holding(&tickslock))
+    panic("timerset");
+  if(timers.n == NTIMER)
+    panic("timerset: too many timers");
+  t->when = when;
+  t->fn = fn;
+  t->arg = arg;
+  t->fired = 0;
+  place(timers.n++, t);
+  fix(t->slot);
+}
+
+// Stop t if it is still pending.  Once this returns, fn is
+// not running and will not be called.  Caller must hold
+// tickslock.
+void
+timercancel(struct timer *t)
+{
+  if(!holding(&tickslock))
+    panic("timercancel");
+  if(t->slot >= 0)
+    removeslot(t->slot);
+}
+
+// Fire the timers that are due.  Called from the timer
+// interrupt with tickslock held.
+void
+timertick(void)
+{
+  struct timer *t;
+
+  while(timers.n > 0 && (int)(timers.heap[0]->when - ticks) <= 0){
+    t = timers.heap[0];
+    removeslot(0);
+    t->fired = 1;
+    t->fn(t->arg);
+  }
+}
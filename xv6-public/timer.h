@@ -0,0 +1,10 @@
+// Kernel timer: calls fn(arg) from the timer interrupt once
+// ticks reaches when.  Set up by timerset(), which the owner
+// pairs with timercancel() before the timer goes away.
+struct timer {
+  uint when;             // Tick at which to fire
+  void (*fn)(void*);     // Called with tickslock held; must not sleep
+  void *arg;
+  int slot;              // Index in the timer heap, or -1 if not pending
+  int fired;             // Has fn been called?
+};
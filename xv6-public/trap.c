@@ -37,6 +37,8 @@ idtinit(void)
 void
 trap(struct trapframe *tf)
 {
+  struct cpu *c;
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
@@ -49,10 +51,14 @@ trap(struct trapframe *tf)
 
   switch(tf->trapno){
   case T_IRQ0 + IRQ_TIMER:
+    c = mycpu();
+    c->nticks++;
+    if(c->proc == 0)
+      c->nidleticks++;
     if(cpuid() == 0){
       acquire(&tickslock);
       ticks++;
-      wakeup(&ticks);
+      timertick();
       release(&tickslock);
     }
     lapiceoi();
@@ -74,13 +80,22 @@ trap(struct trapframe *tf)
     break;
   case T_PGFLT:
     uint failed_addr = PGROUNDDOWN(rcr2());
-    if (handle_pagefault(failed_addr)) {
+    if (handle_pagefault(failed_addr, tf->err)) {
       break;
     } else {
       cprintf("Segmentation Fault\n");
       // kill the process
       exit();
     }
+  case T_TLBFLUSH:
+    tlbpoll();
+    lapiceoi();
+    break;
+  case T_RESCHED:
+    // Only needed to get out of hlt; scheduler() looks again.
+    mycpu()->nresched++;
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -114,7 +129,7 @@ trap(struct trapframe *tf)
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
      tf->trapno == T_IRQ0+IRQ_TIMER)
-    yield();
+    schedtick();
 
   // Check if the process has been killed since we yielded
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
@@ -92,6 +92,20 @@ atoi(const char *s)
   return n;
 }
 
+// a / b, where a may not fit in 32 bits: user programs have no
+// libgcc to do 64-bit division, so scale both down until it does.
+uint
+div64(uint64 a, uint b)
+{
+  while(a >> 32){
+    a >>= 1;
+    b >>= 1;
+  }
+  if(b == 0)
+    return 0;
+  return (uint)a / b;
+}
+
 void*
 memmove(void *vdst, const void *vsrc, int n)
 {
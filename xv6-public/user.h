@@ -3,6 +3,12 @@ struct stat;
 struct rtcdate;
 struct wmapinfo;
 struct pgdirinfo;
+struct cpuinfo;
+struct pinfo;
+struct lockstat;
+struct bcachestat;
+struct idestat;
+struct uthread_lock;
 
 // system calls
 int fork(void);
@@ -14,6 +20,11 @@ int read(int, void*, int);
 int close(int);
 int kill(int);
 int exec(char*, char**);
+int spawn(char*, char**, int*);
+int clone(void(*)(void*), void*, void*);
+int join(void**);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
 int open(const char*, int);
 int mknod(const char*, short, short);
 int unlink(const char*);
@@ -31,6 +42,15 @@ int wunmap(uint);
 uint wremap(uint, int, int, int);
 int getpgdirinfo(struct pgdirinfo*);
 int getwmapinfo(struct wmapinfo*);
+int getcpuinfo(struct cpuinfo*);
+int getpinfo(struct pinfo*);
+int settickets(int);
+int setaffinity(uint);
+uint lockbench(int);
+int getlockstat(struct lockstat*, int);
+int getbcachestat(struct bcachestat*);
+int setbcachemax(int);
+int getidestat(struct idestat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -45,3 +65,14 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+uint div64(uint64, uint);
+
+// uthread.c
+struct uthread_lock {
+  volatile uint locked;
+};
+int uthread_create(void(*)(void*), void*);
+int uthread_join(void);
+void uthread_lock_init(struct uthread_lock*);
+void uthread_lock_acquire(struct uthread_lock*);
+void uthread_lock_release(struct uthread_lock*);
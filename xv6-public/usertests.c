@@ -7,6 +7,9 @@
 #include "syscall.h"
 #include "traps.h"
 #include "memlayout.h"
+#include "wmap.h"
+#include "sched.h"
+#include "bcache.h"
 
 char buf[8192];
 char name[3];
@@ -300,6 +303,450 @@ exectest(void)
   }
 }
 
+// spawn a child with its stdout on a pipe, and check its output
+void
+spawntest(void)
+{
+  int fds[2], fdmap[16], i, n, pid;
+  char *argv[] = { "echo", "spawned", 0 };
+  char buf[32];
+
+  printf(stdout, "spawn test\n");
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  for(i = 0; i < 16; i++)
+    fdmap[i] = -1;
+  fdmap[1] = fds[1];
+  pid = spawn("echo", argv, fdmap);
+  if(pid < 0){
+    printf(stdout, "spawn echo failed\n");
+    exit();
+  }
+  close(fds[1]);
+  n = read(fds[0], buf, sizeof(buf)-1);
+  close(fds[0]);
+  buf[n < 0 ? 0 : n] = 0;
+  if(strcmp(buf, "spawned\n") != 0){
+    printf(stdout, "spawn: wrong output\n");
+    exit();
+  }
+  if(wait() != pid){
+    printf(stdout, "spawn: wait wrong pid\n");
+    exit();
+  }
+  fdmap[1] = 99;
+  if(spawn("echo", argv, fdmap) >= 0){
+    printf(stdout, "spawn accepted a bad fd\n");
+    exit();
+  }
+  if(spawn("nonexistent", argv, 0) >= 0){
+    printf(stdout, "spawn of a missing file succeeded\n");
+    exit();
+  }
+  printf(stdout, "spawn test ok\n");
+}
+
+// initialized data is loaded from the executable's shared page
+// cache pages; a child's write must get it a private copy
+int cowdata = 1;
+
+void
+cowtest(void)
+{
+  int fds[2], pid;
+  char c;
+
+  printf(stdout, "cow test\n");
+  if(pipe(fds) != 0){
+    printf(stdout, "pipe() failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    cowdata = 2;
+    c = '0' + cowdata;
+    write(fds[1], &c, 1);
+    exit();
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 1 || c != '2'){
+    printf(stdout, "cow: child did not see its own write\n");
+    exit();
+  }
+  close(fds[0]);
+  wait();
+  if(cowdata != 1){
+    printf(stdout, "cow: parent saw the child's write\n");
+    exit();
+  }
+  printf(stdout, "cow test ok\n");
+}
+
+// copy the file src over dst, without truncating it
+void
+copyfile(char *src, char *dst)
+{
+  int fd0, fd1, n;
+
+  fd0 = open(src, O_RDONLY);
+  fd1 = open(dst, O_CREATE | O_RDWR);
+  if(fd0 < 0 || fd1 < 0){
+    printf(stdout, "copy %s to %s: open failed\n", src, dst);
+    exit();
+  }
+  while((n = read(fd0, buf, sizeof(buf))) > 0){
+    if(write(fd1, buf, n) != n){
+      printf(stdout, "copy %s to %s: write failed\n", src, dst);
+      exit();
+    }
+  }
+  close(fd0);
+  close(fd1);
+}
+
+// run "pcbin pcdir" with its output in pcout
+void
+runpcbin(void)
+{
+  char *argv[] = { "pcbin", "pcdir", 0 };
+  int pid;
+
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    close(1);
+    open("pcout", O_CREATE | O_RDWR);
+    exec("pcbin", argv);
+    exit();
+  }
+  wait();
+}
+
+// rewriting a binary whose pages are cached must drop them, so
+// that the next exec runs the new program
+void
+pcexectest(void)
+{
+  int fd;
+
+  printf(stdout, "page cache exec test\n");
+  unlink("pcdir");
+  copyfile("echo", "pcbin");
+  runpcbin();
+  if((fd = open("pcdir", O_RDONLY)) >= 0){
+    close(fd);
+    printf(stdout, "pcexec: echo made a directory\n");
+    exit();
+  }
+  copyfile("mkdir", "pcbin");
+  runpcbin();
+  if((fd = open("pcdir", O_RDONLY)) < 0){
+    printf(stdout, "pcexec: exec ran the old binary\n");
+    exit();
+  }
+  close(fd);
+  unlink("pcdir");
+  unlink("pcbin");
+  unlink("pcout");
+  printf(stdout, "page cache exec test ok\n");
+}
+
+// threads share memory, and see each other's wmap regions
+#define NTHREADS 4
+struct uthread_lock tlock;
+volatile int tcount;
+char *tregion;
+
+void
+threadfn(void *arg)
+{
+  int i, n = (int)arg;
+
+  for(i = 0; i < 1000; i++){
+    uthread_lock_acquire(&tlock);
+    tcount++;
+    uthread_lock_release(&tlock);
+  }
+  tregion[n*4096] = 'a' + n;
+}
+
+void
+threadtest(void)
+{
+  int i;
+
+  printf(stdout, "thread test\n");
+  uthread_lock_init(&tlock);
+  tcount = 0;
+  tregion = (char*)wmap(0, NTHREADS*4096, MAP_PRIVATE|MAP_ANONYMOUS, -1);
+  if((int)tregion == FAILED){
+    printf(stdout, "thread test: wmap failed\n");
+    exit();
+  }
+  for(i = 0; i < NTHREADS; i++){
+    if(uthread_create(threadfn, (void*)i) < 0){
+      printf(stdout, "uthread_create failed\n");
+      exit();
+    }
+  }
+  for(i = 0; i < NTHREADS; i++){
+    if(uthread_join() < 0){
+      printf(stdout, "uthread_join failed\n");
+      exit();
+    }
+  }
+  if(uthread_join() != -1){
+    printf(stdout, "uthread_join with no threads succeeded\n");
+    exit();
+  }
+  if(tcount != NTHREADS*1000){
+    printf(stdout, "thread test: count %d\n", tcount);
+    exit();
+  }
+  for(i = 0; i < NTHREADS; i++){
+    if(tregion[i*4096] != 'a' + i){
+      printf(stdout, "thread test: wmap region not shared\n");
+      exit();
+    }
+  }
+  if(wunmap((uint)tregion) != SUCCESS){
+    printf(stdout, "thread test: wunmap failed\n");
+    exit();
+  }
+  printf(stdout, "thread test ok\n");
+}
+
+// page-table pages that a wmap region needed are freed with it
+void
+ptpagetest(void)
+{
+  struct pgdirinfo before, during, after;
+  char *p;
+  int i, len;
+
+  printf(stdout, "page table reclaim test\n");
+  len = 12*1024*1024;
+  if(getpgdirinfo(&before) < 0){
+    printf(stdout, "getpgdirinfo failed\n");
+    exit();
+  }
+  p = (char*)wmap(0, len, MAP_PRIVATE|MAP_ANONYMOUS, -1);
+  if((int)p == FAILED){
+    printf(stdout, "wmap failed\n");
+    exit();
+  }
+  // one page every megabyte, in at least three 4MB page tables
+  for(i = 0; i < len; i += 1024*1024)
+    p[i] = 1;
+  getpgdirinfo(&during);
+  if(during.n_ptpages < before.n_ptpages + 3){
+    printf(stdout, "ptpage: %d page-table pages, %d before the region\n",
+           during.n_ptpages, before.n_ptpages);
+    exit();
+  }
+  if(wunmap((uint)p) < 0){
+    printf(stdout, "wunmap failed\n");
+    exit();
+  }
+  getpgdirinfo(&after);
+  if(after.n_ptpages != before.n_ptpages){
+    printf(stdout, "ptpage: %d page-table pages left, not %d\n",
+           after.n_ptpages, before.n_ptpages);
+    exit();
+  }
+  printf(stdout, "page table reclaim test ok\n");
+}
+
+// a child sleeps in futex_wait on a MAP_SHARED word until the parent wakes it
+void
+futextest(void)
+{
+  int *w, pid, i;
+
+  printf(stdout, "futex test\n");
+  w = (int*)wmap(0, 4096, MAP_SHARED|MAP_ANONYMOUS, -1);
+  if((int)w == FAILED){
+    printf(stdout, "futex test: wmap failed\n");
+    exit();
+  }
+  *w = 0;  // fork shares only pages already present
+  if(futex_wait(w, 1) != -1){
+    printf(stdout, "futex_wait slept on a changed word\n");
+    exit();
+  }
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "futex test: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    // 0 only if it really slept and was woken
+    w[1] = futex_wait(w, 0) == 0 ? 2 : 1;
+    exit();
+  }
+  // Retry until the child is asleep to be woken.
+  for(i = 0; i < 100; i++){
+    if(futex_wake(w, 1) == 1)
+      break;
+    sleep(1);
+  }
+  if(i == 100)
+    kill(pid);
+  wait();
+  if(i == 100){
+    printf(stdout, "futex test: futex_wake never woke the child\n");
+    exit();
+  }
+  if(w[1] != 2){
+    printf(stdout, "futex test: child did not sleep in futex_wait\n");
+    exit();
+  }
+  wunmap((uint)w);
+  printf(stdout, "futex test ok\n");
+}
+
+// busy children run off the per-cpu run queues and show up in the counters
+void
+schedtest(void)
+{
+  struct cpuinfo before, after;
+  struct pinfo pi;
+  uint n0, n1;
+  int i, j, pid;
+#ifdef SCHED_STRIDE
+  int k, pids[2];
+  uint rt[2];
+#endif
+
+  printf(stdout, "sched test\n");
+  if(getcpuinfo(&before) < 0 || before.ncpu < 1){
+    printf(stdout, "getcpuinfo failed\n");
+    exit();
+  }
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf(stdout, "sched test: fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      for(j = 0; j < 20; j++)
+        sleep(1);
+      exit();
+    }
+  }
+  for(i = 0; i < 4; i++)
+    wait();
+  getcpuinfo(&after);
+  n0 = n1 = 0;
+  for(i = 0; i < before.ncpu; i++){
+    n0 += before.nswtch[i];
+    n1 += after.nswtch[i];
+  }
+  if(n1 - n0 < 4*20){
+    printf(stdout, "sched test: only %d switches\n", n1 - n0);
+    exit();
+  }
+  if(getpinfo(&pi) < 0){
+    printf(stdout, "getpinfo failed\n");
+    exit();
+  }
+  for(i = 0; i < NPROC; i++)
+    if(pi.inuse[i] && pi.pid[i] == getpid())
+      break;
+  if(i == NPROC || pi.nsched[i] == 0){
+    printf(stdout, "sched test: getpinfo lost us\n");
+    exit();
+  }
+
+  // tickets are checked and inherited across fork
+  if(settickets(0) != -1 || settickets(3) != 0){
+    printf(stdout, "settickets failed\n");
+    exit();
+  }
+  pid = fork();
+  if(pid == 0){
+    getpinfo(&pi);
+    for(i = 0; i < NPROC; i++)
+      if(pi.inuse[i] && pi.pid[i] == getpid())
+        break;
+    if(i == NPROC || pi.tickets[i] != 3 || pi.stride[i] != STRIDE1/3){
+      printf(stdout, "sched test: tickets not inherited\n");
+      exit();
+    }
+    exit();
+  }
+  wait();
+  settickets(1);
+
+#ifdef SCHED_STRIDE
+  // two busy children pinned to one cpu share it 3:1 by tickets
+  for(k = 0; k < 2; k++){
+    pids[k] = fork();
+    if(pids[k] < 0){
+      printf(stdout, "sched test: fork failed\n");
+      exit();
+    }
+    if(pids[k] == 0){
+      setaffinity(1);
+      settickets(k == 0 ? 3 : 1);
+      for(;;)
+        ;
+    }
+  }
+  sleep(100);
+  getpinfo(&pi);
+  for(k = 0; k < 2; k++){
+    rt[k] = 0;
+    for(i = 0; i < NPROC; i++)
+      if(pi.inuse[i] && pi.pid[i] == pids[k])
+        for(j = 0; j < NMLFQ; j++)
+          rt[k] += pi.ticks[i][j];
+    kill(pids[k]);
+  }
+  wait();
+  wait();
+  if(rt[0] + rt[1] < 50 || 2*rt[0] < 3*rt[1]){
+    printf(stdout, "sched test: 3 tickets ran %d ticks, 1 ticket %d\n",
+           rt[0], rt[1]);
+    exit();
+  }
+#endif
+
+  // pinned to cpu 0, we must stay there, even busy
+  if(setaffinity(0) != -1 || setaffinity(1) != 0){
+    printf(stdout, "setaffinity failed\n");
+    exit();
+  }
+  getpinfo(&pi);
+  for(i = 0; i < NPROC; i++)
+    if(pi.inuse[i] && pi.pid[i] == getpid())
+      break;
+  if(i == NPROC || pi.affinity[i] != 1 || pi.cpu[i] != 0){
+    printf(stdout, "sched test: affinity not set\n");
+    exit();
+  }
+  n0 = pi.nmigrate[i];
+  for(j = uptime(); uptime() < j + 5; )
+    ;
+  getpinfo(&pi);
+  if(pi.cpu[i] != 0 || pi.nmigrate[i] != n0){
+    printf(stdout, "sched test: pinned process ran on cpu %d\n", pi.cpu[i]);
+    exit();
+  }
+  setaffinity(~0);
+  printf(stdout, "sched test ok\n");
+}
+
 // simple fork and pipe read/write
 
 void
@@ -1200,6 +1647,93 @@ bigfile(void)
   printf(1, "bigfile test ok\n");
 }
 
+// read a file twice the size of the cache with the cache held to NBUF
+// buffers: every block must come back right, the cache must not grow,
+// and most of the blocks must miss and evict others.
+void
+bcachetest(void)
+{
+  struct bcachestat st0, st1;
+  int fd, i, oldmax, nblk, nmiss, nevict;
+
+  printf(1, "bcache test\n");
+
+  nblk = 2*NBUF;
+  unlink("bcachefile");
+  fd = open("bcachefile", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf(1, "cannot create bcachefile\n");
+    exit();
+  }
+  for(i = 0; i < nblk; i++){
+    memset(buf, 'a' + i%26, BSIZE);
+    ((int*)buf)[0] = i;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf(1, "write bcachefile failed\n");
+      exit();
+    }
+  }
+  close(fd);
+
+  if(getbcachestat(&st0) < 0){
+    printf(1, "getbcachestat failed\n");
+    exit();
+  }
+  oldmax = st0.maxbuf;
+  if(setbcachemax(NBUF-1) != -1){
+    printf(1, "setbcachemax below NBUF succeeded\n");
+    exit();
+  }
+  if(setbcachemax(NBUF) < 0){
+    printf(1, "setbcachemax failed\n");
+    exit();
+  }
+  getbcachestat(&st0);
+  if(st0.maxbuf != NBUF){
+    printf(1, "bcache maxbuf %d, not %d\n", st0.maxbuf, NBUF);
+    exit();
+  }
+
+  fd = open("bcachefile", 0);
+  if(fd < 0){
+    printf(1, "cannot open bcachefile\n");
+    exit();
+  }
+  for(i = 0; i < nblk; i++){
+    if(read(fd, buf, BSIZE) != BSIZE){
+      printf(1, "read bcachefile failed\n");
+      exit();
+    }
+    if(((int*)buf)[0] != i || buf[BSIZE-1] != 'a' + i%26){
+      printf(1, "read bcachefile wrong data\n");
+      exit();
+    }
+  }
+  close(fd);
+  getbcachestat(&st1);
+  setbcachemax(oldmax);
+  unlink("bcachefile");
+
+  if(st1.ngrow != st0.ngrow || st1.nbuf > st0.nbuf){
+    printf(1, "bcache grew past maxbuf: %d buffers\n", st1.nbuf);
+    exit();
+  }
+  // At most st0.nbuf of the blocks can have stayed cached.
+  nmiss = st1.nmiss - st0.nmiss;
+  nevict = st1.nevict - st0.nevict;
+  if(nmiss < nblk - st0.nbuf || nevict < nblk - st0.nbuf){
+    printf(1, "bcache: %d misses, %d evictions for %d blocks\n",
+           nmiss, nevict, nblk);
+    exit();
+  }
+  if(st1.nprefetch == st0.nprefetch){
+    printf(1, "bcache: no readahead on a sequential read\n");
+    exit();
+  }
+
+  printf(1, "bcache test ok\n");
+}
+
 void
 fourteen(void)
 {
@@ -1546,6 +2080,55 @@ sbrktest(void)
   printf(stdout, "sbrk test OK\n");
 }
 
+// sbrk only reserves address space; pages are allocated on
+// first touch.  Reserve more than physical memory, touch a
+// couple of pages, and make sure fork copes with the holes.
+void
+lazysbrktest(void)
+{
+  char *a, *oldbrk;
+  int pid;
+  uint amt;
+
+  printf(stdout, "lazy sbrk test\n");
+  oldbrk = sbrk(0);
+  amt = 512*1024*1024;
+  a = sbrk(amt);
+  if(a != oldbrk){
+    printf(stdout, "lazy sbrk failed to reserve\n");
+    exit();
+  }
+  if(a[4096] != 0 || a[amt-1] != 0){
+    printf(stdout, "lazy sbrk page not zero\n");
+    exit();
+  }
+  a[4096] = 1;
+  a[amt-1] = 2;
+  pid = fork();
+  if(pid < 0){
+    printf(stdout, "lazy sbrk fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(a[4096] != 1 || a[amt-1] != 2 || a[amt/2] != 0){
+      printf(stdout, "lazy sbrk child saw wrong data\n");
+      exit();
+    }
+    a[amt/2] = 3;
+    exit();
+  }
+  wait();
+  if(a[amt/2] != 0){
+    printf(stdout, "lazy sbrk child write leaked into parent\n");
+    exit();
+  }
+  if(sbrk(-amt) == (char*)0xffffffff || sbrk(0) != oldbrk){
+    printf(stdout, "lazy sbrk could not shrink\n");
+    exit();
+  }
+  printf(stdout, "lazy sbrk test OK\n");
+}
+
 void
 validateint(int *p)
 {
@@ -1768,6 +2351,14 @@ main(int argc, char *argv[])
   bigargtest();
   bsstest();
   sbrktest();
+  lazysbrktest();
+  spawntest();
+  cowtest();
+  pcexectest();
+  threadtest();
+  ptpagetest();
+  futextest();
+  schedtest();
   validatetest();
 
   opentest();
@@ -1787,6 +2378,7 @@ main(int argc, char *argv[])
   rmdot();
   fourteen();
   bigfile();
+  bcachetest();
   subdir();
   linktest();
   unlinkread();
@@ -0,0 +1,75 @@
+#include "types.h"
+#include "user.h"
+#include "x86.h"
+
+// User-level threads on top of clone() and join().
+//
+// clone() needs a page-aligned, one-page stack, so
+// uthread_create() allocates two pages with malloc() and uses
+// the aligned page inside them, keeping the malloc() pointer
+// just below it for uthread_join() to free.  malloc() is not
+// thread-safe: create and join threads from one thread.
+
+#define TSTACKSIZE 4096
+
+// Entry point of every thread.  fn and arg are stored at the
+// bottom of the stack page; exit when fn returns.
+static void
+uthread_start(void *stack)
+{
+  void (*fn)(void*) = ((void**)stack)[0];
+  void *arg = ((void**)stack)[1];
+
+  fn(arg);
+  exit();
+}
+
+// Start a thread running fn(arg).  Returns its pid, or -1.
+int
+uthread_create(void (*fn)(void*), void *arg)
+{
+  char *mem, *stack;
+  int pid;
+
+  if((mem = malloc(2*TSTACKSIZE)) == 0)
+    return -1;
+  stack = (char*)(((uint)mem + TSTACKSIZE) & ~(TSTACKSIZE-1));
+  ((void**)stack)[-1] = mem;
+  ((void**)stack)[0] = (void*)fn;
+  ((void**)stack)[1] = arg;
+  if((pid = clone(uthread_start, stack, stack)) < 0)
+    free(mem);
+  return pid;
+}
+
+// Wait for a thread to exit and free its stack.
+// Returns its pid, or -1 if there are no threads.
+int
+uthread_join(void)
+{
+  void *stack;
+  int pid;
+
+  if((pid = join(&stack)) > 0)
+    free(((void**)stack)[-1]);
+  return pid;
+}
+
+void
+uthread_lock_init(struct uthread_lock *lk)
+{
+  lk->locked = 0;
+}
+
+void
+uthread_lock_acquire(struct uthread_lock *lk)
+{
+  while(xchg(&lk->locked, 1) != 0)
+    ;
+}
+
+void
+uthread_lock_release(struct uthread_lock *lk)
+{
+  xchg(&lk->locked, 0);
+}
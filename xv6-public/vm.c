@@ -6,6 +6,7 @@
 #include "mmu.h"
 #include "proc.h"
 #include "elf.h"
+#include "traps.h"
 
 extern char data[];  // defined by kernel.ld
 pde_t *kpgdir;  // for use in scheduler()
@@ -16,17 +17,31 @@ void
 seginit(void)
 {
   struct cpu *c;
+  int apicid;
+
+  // Find this cpu by its APIC ID.  Once %gs is loaded below,
+  // mycpu() finds it with a single load instead.
+  apicid = lapicid();
+  for(c = cpus; c < &cpus[ncpu]; c++)
+    if(c->apicid == apicid)
+      break;
+  if(c == &cpus[ncpu])
+    panic("unknown apicid");
 
   // Map "logical" addresses to virtual addresses using identity map.
   // Cannot share a CODE descriptor for both kernel and user
   // because it would have to have DPL_USR, but the CPU forbids
   // an interrupt from CPL=0 to DPL=3.
-  c = &cpus[cpuid()];
   c->gdt[SEG_KCODE] = SEG(STA_X|STA_R, 0, 0xffffffff, 0);
   c->gdt[SEG_KDATA] = SEG(STA_W, 0, 0xffffffff, 0);
   c->gdt[SEG_UCODE] = SEG(STA_X|STA_R, 0, 0xffffffff, DPL_USER);
   c->gdt[SEG_UDATA] = SEG(STA_W, 0, 0xffffffff, DPL_USER);
+
+  // Map cpu-local storage: %gs:0 is c->cpu, %gs:4 is c->proc.
+  c->gdt[SEG_KCPU] = SEG(STA_W, &c->cpu, 8, 0);
+  c->cpu = c;
   lgdt(c->gdt, sizeof(c->gdt));
+  loadgs(SEG_KCPU << 3);
 }
 
 // Return the address of the PTE in page table pgdir
@@ -160,7 +175,7 @@ switchuvm(struct proc *p)
     panic("switchuvm: no process");
   if(p->kstack == 0)
     panic("switchuvm: no kstack");
-  if(p->pgdir == 0)
+  if(p->vm->pgdir == 0)
     panic("switchuvm: no pgdir");
 
   pushcli();
@@ -173,7 +188,12 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
-  lcr3(V2P(p->pgdir));  // switch to process's address space
+  // Threads of one process share a page table; switching
+  // between them keeps %cr3 and the TLB.
+  if(mycpu()->upgdir != p->vm->pgdir){
+    mycpu()->upgdir = p->vm->pgdir;
+    lcr3(V2P(p->vm->pgdir));  // switch to process's address space
+  }
   popcli();
 }
 
@@ -278,6 +298,131 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   return newsz;
 }
 
+// Pages removed from a page table that other CPUs may still
+// reach through their TLBs.  They are freed in batches, each
+// after a TLB shootdown.
+struct zapbatch {
+  pde_t *pgdir;
+  int n;
+  char *page[32];
+};
+
+static void
+zapflush(struct zapbatch *b)
+{
+  tlbshootdown(b->pgdir);
+  while(b->n > 0)
+    kfree(b->page[--b->n]);
+}
+
+static void
+zapadd(struct zapbatch *b, char *v)
+{
+  if(b->n == NELEM(b->page))
+    zapflush(b);
+  b->page[b->n++] = v;
+}
+
+// Unmap and free the user pages in [start, end) of pgdir, then
+// free the page-table pages left with no entries, so that a
+// process which maps and unmaps many regions does not
+// accumulate them until exit.  Other threads of the process
+// may be running, so nothing is freed until every CPU using
+// pgdir has flushed its TLB.
+void
+unmapuvm(pde_t *pgdir, uint start, uint end)
+{
+  struct zapbatch b;
+  pte_t *pte, *pgtab;
+  uint a, d, i;
+
+  if(start >= end || end > KERNBASE)
+    return;
+  b.pgdir = pgdir;
+  b.n = 0;
+  for(a = PGROUNDUP(start); a < end; a += PGSIZE){
+    pte = walkpgdir(pgdir, (char*)a, 0);
+    if(!pte)
+      a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
+    else if((*pte & PTE_P) != 0){
+      zapadd(&b, P2V(PTE_ADDR(*pte)));
+      *pte = 0;
+    }
+  }
+  for(d = PDX(start); d <= PDX(end - 1); d++){
+    if((pgdir[d] & PTE_P) == 0)
+      continue;
+    pgtab = (pte_t*)P2V(PTE_ADDR(pgdir[d]));
+    for(i = 0; i < NPTENTRIES; i++)
+      if(pgtab[i] != 0)
+        break;
+    if(i == NPTENTRIES){
+      pgdir[d] = 0;
+      zapadd(&b, (char*)pgtab);
+    }
+  }
+  zapflush(&b);
+}
+
+// Make every CPU drop the translations it caches for pgdir,
+// after the caller has changed or removed entries in it.
+// Returns once no CPU can use an old translation.  The caller
+// may hold spinlocks: a CPU spinning in acquire() with
+// interrupts off still answers, through tlbpoll().
+void
+tlbshootdown(pde_t *pgdir)
+{
+  struct cpu *c, *me;
+  uint bit;
+
+  pushcli();
+  me = mycpu();
+  bit = 1 << (me - cpus);
+  if(me->upgdir == pgdir)
+    lcr3(V2P(pgdir));
+  // Order the caller's page table writes before reading upgdir:
+  // a CPU that loads pgdir after this point sees the new entries.
+  __sync_synchronize();
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(c == me || c->upgdir != pgdir)
+      continue;
+    __sync_fetch_and_or(&c->tlbpend, bit);
+    lapicipi(c->apicid, T_TLBFLUSH);
+  }
+  for(c = cpus; c < cpus+ncpu; c++)
+    while(c->tlbpend & bit)
+      tlbpoll();
+  popcli();
+}
+
+// Flush this CPU's TLB if other CPUs have asked for it, and
+// tell them it is done.  Called with interrupts off.
+void
+tlbpoll(void)
+{
+  struct cpu *c;
+  uint m;
+
+  c = mycpu();
+  if((m = c->tlbpend) != 0){
+    lcr3(rcr3());
+    __sync_fetch_and_and(&c->tlbpend, ~m);
+  }
+}
+
+// Count the page-table pages that map user addresses in pgdir.
+int
+countptpages(pde_t *pgdir)
+{
+  int d, n;
+
+  n = 0;
+  for(d = 0; d < PDX(KERNBASE); d++)
+    if(pgdir[d] & PTE_P)
+      n++;
+  return n;
+}
+
 // Free a page table and all the physical memory pages
 // in the user part.
 void
@@ -311,7 +456,8 @@ clearpteu(pde_t *pgdir, char *uva)
 }
 
 // Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  Pages that were never touched are not
+// present in the parent and stay holes in the child.
 pde_t*
 copyuvm(pde_t *pgdir, uint sz)
 {
@@ -323,12 +469,22 @@ copyuvm(pde_t *pgdir, uint sz)
   if((d = setupkvm()) == 0)
     return 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
+    if((flags & (PTE_U|PTE_W)) == PTE_U){
+      // Read-only pages come from the executable page cache;
+      // share them, and a write will copy (see handle_pagefault).
+      if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
+        goto bad;
+      kdup(P2V(pa));
+      continue;
+    }
     if((mem = kalloc()) == 0)
       goto bad;
     memmove(mem, (char*)P2V(pa), PGSIZE);
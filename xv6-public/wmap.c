@@ -7,6 +7,8 @@
 #include "param.h"
 #include "fs.h"
 #include "file.h"
+#include "x86.h"
+#include "spinlock.h"
 
 void selectionSort(struct mapping arr[], int n) {
     int i, j, minIndex;
@@ -27,41 +29,49 @@ void selectionSort(struct mapping arr[], int n) {
 }
 
 uint wmap(uint addr, int length, int flags, int fd) {
-    struct proc *curproc = myproc();
+    struct vmspace *vm = myproc()->vm;
     // Have we reached the max number of mappings?
     // Is the length that the user provides > 0?
-    if (curproc->num_mappings >= MAX_WMMAP_INFO || length <= 0 || ((flags & MAP_PRIVATE) && (flags & MAP_SHARED))) {
+    if (length <= 0 || ((flags & MAP_PRIVATE) && (flags & MAP_SHARED))) {
+        return FAILED;
+    }
+    acquire(&vm->lock);
+    if (vm->num_mappings >= MAX_WMMAP_INFO) {
+        release(&vm->lock);
         return FAILED;
     }
     uint new_addr = 0x60000000;
     if (flags & MAP_FIXED) { // Consider case of fixed addr
         // Check that addr fits within WMAP space + is page aligned
         if (addr < 0x60000000 || addr >= 0x80000000 || addr % PGSIZE != 0) {
+            release(&vm->lock);
             return FAILED;
         }
         // Iterate through mappings to find appropriate region to insert new region
-        for (int i = 0; i < curproc->num_mappings; i++) {
-            uint mapping_end = curproc->mappings[i].addr + curproc->mappings[i].length;
+        for (int i = 0; i < vm->num_mappings; i++) {
+            uint mapping_end = vm->mappings[i].addr + vm->mappings[i].length;
             if (
-                (addr >= curproc->mappings[i].addr && addr < mapping_end) || // Does the start of the region overlap with current region
-                (addr + length - 1>= curproc->mappings[i].addr && addr + length - 1< mapping_end) ||
-                (curproc->mappings[i].addr >= addr && curproc->mappings[i].addr < addr + length - 1) || 
+                (addr >= vm->mappings[i].addr && addr < mapping_end) || // Does the start of the region overlap with current region
+                (addr + length - 1>= vm->mappings[i].addr && addr + length - 1< mapping_end) ||
+                (vm->mappings[i].addr >= addr && vm->mappings[i].addr < addr + length - 1) || 
                 (mapping_end >= addr && mapping_end < addr + length - 1)
             ) {
+                release(&vm->lock);
                 return FAILED;
             }
         }
         new_addr = addr;
     } else {
         // Also iterate, but find next available page instead of failing
-        for (int i = 0; i < curproc->num_mappings; i++) {
-            uint mapping_end = curproc->mappings[i].addr + curproc->mappings[i].length;
-            if ((new_addr >= curproc->mappings[i].addr && new_addr < mapping_end) || (new_addr + length - 1 >= curproc->mappings[i].addr && new_addr + length - 1 < mapping_end) || (curproc->mappings[i].addr >= new_addr && curproc->mappings[i].addr < new_addr + length - 1) || (mapping_end >= new_addr && mapping_end < new_addr + length - 1)) {
+        for (int i = 0; i < vm->num_mappings; i++) {
+            uint mapping_end = vm->mappings[i].addr + vm->mappings[i].length;
+            if ((new_addr >= vm->mappings[i].addr && new_addr < mapping_end) || (new_addr + length - 1 >= vm->mappings[i].addr && new_addr + length - 1 < mapping_end) || (vm->mappings[i].addr >= new_addr && vm->mappings[i].addr < new_addr + length - 1) || (mapping_end >= new_addr && mapping_end < new_addr + length - 1)) {
                 new_addr = PGROUNDUP(mapping_end);
             }
         }
         // Check if length is in bounds
         if (new_addr + length - 1 >= KERNBASE) {
+            release(&vm->lock);
             return FAILED;
         }
     }
@@ -72,56 +82,66 @@ uint wmap(uint addr, int length, int flags, int fd) {
     new_mapping.flags = flags;
     new_mapping.fd = fd;
     new_mapping.num_pages_loaded = 0;
-    curproc->mappings[curproc->num_mappings++] = new_mapping;
+    vm->mappings[vm->num_mappings++] = new_mapping;
     // Sort the mappings to make it easier to perform other operations
-    selectionSort(curproc->mappings, curproc->num_mappings);
+    selectionSort(vm->mappings, vm->num_mappings);
+    release(&vm->lock);
     return new_mapping.addr;
 }
 
+// Index of the mapping that starts at addr, or -1.
+// Caller must hold vm->lock.
+static int findmapping(struct vmspace *vm, uint addr) {
+    for (int i = 0; i < vm->num_mappings; i++) {
+        if (vm->mappings[i].addr == addr) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 int wunmap(uint addr) {
     struct proc *curproc = myproc();
+    struct vmspace *vm = curproc->vm;
     if (addr % PGSIZE != 0) {
         return FAILED;
     }
-    int found = 0;
-    // Iterate to find correct page to unmap
-    for (int i = 0; i < curproc->num_mappings; i++) {
-        if (curproc->mappings[i].addr == addr) {
-            uint start = curproc->mappings[i].addr;
-            uint end = PGROUNDUP(curproc->mappings[i].addr + curproc->mappings[i].length);
-            found = 1;
-            // Check if shared + file backed --> write to file
-            uint anon = curproc->mappings[i].flags & MAP_ANONYMOUS;
-            uint shared = curproc->mappings[i].flags & MAP_SHARED;
-            if (shared && !anon) {
-                struct file *f = curproc->ofile[curproc->mappings[i].fd];
-                f->off = 0;
-                // copy it over
-                if (filewrite(f, (char *) start, curproc->mappings[i].length) < 0){
-                    cprintf("filewrite failed\n");
-                    return FAILED; 
-                }
-            }
-            // remove pages from physical memory
-            for (uint start_addr = start; start_addr < end; start_addr += PGSIZE) {
-                pte_t *pte = walkpgdir(curproc->pgdir, (void *)start_addr, 0);
-                if (pte && (*pte & PTE_P)) {
-                    kfree(P2V(PTE_ADDR(*pte)));
-                    *pte = 0;
-                }
-            }
-            // Shift all subsequent mappings one position towards the start to remove from virtual memory
-            for (int j = i; j < curproc->num_mappings; j++) {
-                curproc->mappings[j] = curproc->mappings[j + 1];
-            }
-            curproc->num_mappings--;
-            break;
+    // Find the mapping to unmap
+    acquire(&vm->lock);
+    int i = findmapping(vm, addr);
+    if (i < 0) {
+        release(&vm->lock);
+        return FAILED;
+    }
+    struct mapping m = vm->mappings[i];
+    release(&vm->lock);
+    // Check if shared + file backed --> write to file.
+    // Writing may sleep, so it is done without vm->lock.
+    uint anon = m.flags & MAP_ANONYMOUS;
+    uint shared = m.flags & MAP_SHARED;
+    if (shared && !anon) {
+        struct file *f = curproc->fdt->ofile[m.fd];
+        f->off = 0;
+        // copy it over
+        if (filewrite(f, (char *) m.addr, m.length) < 0){
+            cprintf("filewrite failed\n");
+            return FAILED; 
         }
     }
-    // Check if we actually removed a page
-    if (!found) {
+    acquire(&vm->lock);
+    // Another thread may have unmapped it in the meantime
+    if ((i = findmapping(vm, addr)) < 0) {
+        release(&vm->lock);
         return FAILED;
     }
+    // remove pages from physical memory, along with page-table pages left empty
+    unmapuvm(vm->pgdir, m.addr, PGROUNDUP(m.addr + m.length));
+    // Shift all subsequent mappings one position towards the start to remove from virtual memory
+    for (int j = i; j < vm->num_mappings - 1; j++) {
+        vm->mappings[j] = vm->mappings[j + 1];
+    }
+    vm->num_mappings--;
+    release(&vm->lock);
     return SUCCESS;
 }
 
@@ -129,105 +149,93 @@ uint wremap(uint oldaddr, int oldsize, int newsize, int flags) {
     if (oldaddr % PGSIZE != 0 || newsize <= 0){
         return FAILED;
     }
-    struct proc *curproc = myproc();
-    int found = 0;
-    int i;  // get mapping that we want to remap
-    for(i = 0; i < curproc->num_mappings; i++){
-        if(curproc->mappings[i].addr == oldaddr){
-            found = 1;
-            break;
-        }
-    }
-    if (!found) {
+    struct vmspace *vm = myproc()->vm;
+    uint ret = FAILED;
+    acquire(&vm->lock);
+    int i = findmapping(vm, oldaddr);  // get mapping that we want to remap
+    if (i < 0) {
+        release(&vm->lock);
         return FAILED;
     }
     // 3 cases, same size, smaller size (shrink), larger size (expand)
     int diff = newsize - oldsize;
     // Case 1: same size --> do nothing, keep same address
     if (diff == 0) {
-        return oldaddr;
+        ret = oldaddr;
     } else if (diff < 0) { // Case 2: shrinks mapping
         // set the new size, if shrinking can always stay at current address
-        curproc->mappings[i].length = newsize;
-        int temp = oldsize;
+        vm->mappings[i].length = newsize;
         // remove pages from memory as a result of shrinking
-        while (temp > newsize) {
-            pte_t *pte = walkpgdir(curproc->pgdir, (void *)oldaddr + temp - PGSIZE, 0);
-            if (pte && (*pte & PTE_P)) {
-                kfree(P2V(PTE_ADDR(*pte)));
-                *pte = 0;
-            }
-            temp -= PGSIZE;
-        }
-        return oldaddr;
+        unmapuvm(vm->pgdir, oldaddr + PGROUNDUP(newsize), oldaddr + PGROUNDUP(oldsize));
+        ret = oldaddr;
     } else { // Case 3: larger size, find other address to move mapping
         uint end = oldaddr + newsize - 1;
         // If newsize is out of bounds, fail
         if (end >= KERNBASE) {
-            return FAILED;
-        }
-        // If in bounds and is the last mapping, simply expand size and return current address
-        if (i == curproc->num_mappings - 1) {
-            curproc->mappings[i].length = newsize;
-            return oldaddr;
-        }
-        // Checks if we can move mapping
-        if (flags == 0) { // Can't move mapping
-            // checks if there is more than 1 mapping, and if the newsize overlaps with the other mapping
-            if (curproc->num_mappings >= 2 && i < curproc->num_mappings - 1) {
-                uint next_map_end = curproc->mappings[i + 1].addr;
-                if (end >= next_map_end) {
-                    return FAILED;
-                }
+            ret = FAILED;
+        } else if (i == vm->num_mappings - 1) {
+            // If in bounds and is the last mapping, simply expand size and return current address
+            vm->mappings[i].length = newsize;
+            ret = oldaddr;
+        } else if (flags == 0) { // Can't move mapping
+            // checks if the newsize overlaps with the next mapping
+            uint next_map_end = vm->mappings[i + 1].addr;
+            if (end >= next_map_end) {
+                ret = FAILED;
+            } else {
+                vm->mappings[i].length = newsize;
+                ret = oldaddr;
             }
-            curproc->mappings[i].length = newsize;
-            return oldaddr;
         } else { // Can move mapping
-            uint next_map_end = curproc->mappings[i + 1].addr;
+            uint next_map_end = vm->mappings[i + 1].addr;
             // We need to move the mapping
             if (end >= next_map_end) {
                 // Find the next available address
                 uint new_addr = 0x60000000;
-                for (int i = 0; i < curproc->num_mappings; i++) {
-                    uint mapping_end = curproc->mappings[i].addr + curproc->mappings[i].length;
-                    if ((new_addr >= curproc->mappings[i].addr && new_addr < mapping_end) || (new_addr + newsize - 1 >= curproc->mappings[i].addr && new_addr + newsize - 1 < mapping_end) || (curproc->mappings[i].addr >= new_addr && curproc->mappings[i].addr < new_addr + newsize - 1) || (mapping_end >= new_addr && mapping_end < new_addr + newsize - 1)) {
+                for (int i = 0; i < vm->num_mappings; i++) {
+                    uint mapping_end = vm->mappings[i].addr + vm->mappings[i].length;
+                    if ((new_addr >= vm->mappings[i].addr && new_addr < mapping_end) || (new_addr + newsize - 1 >= vm->mappings[i].addr && new_addr + newsize - 1 < mapping_end) || (vm->mappings[i].addr >= new_addr && vm->mappings[i].addr < new_addr + newsize - 1) || (mapping_end >= new_addr && mapping_end < new_addr + newsize - 1)) {
                         new_addr = PGROUNDUP(mapping_end);
                     }
                 }
                 // Check if in bounds
                 if (new_addr + newsize - 1 >= KERNBASE) {
+                    release(&vm->lock);
                     return FAILED;
                 }
                 // Allocate at new address
                 struct mapping new_mapping;
                 new_mapping.addr = new_addr;
                 new_mapping.length = newsize;
-                new_mapping.flags = curproc->mappings[i].flags;
-                new_mapping.fd = curproc->mappings[i].fd;
-                new_mapping.num_pages_loaded = curproc->mappings[i].num_pages_loaded;
-                curproc->mappings[i] = new_mapping;
+                new_mapping.flags = vm->mappings[i].flags;
+                new_mapping.fd = vm->mappings[i].fd;
+                new_mapping.num_pages_loaded = vm->mappings[i].num_pages_loaded;
+                vm->mappings[i] = new_mapping;
                 // remove form old address
+                int oldsize_orig = oldsize;
                 while (oldsize > 0) {
-                    pte_t *pte = walkpgdir(curproc->pgdir, (void *)(oldaddr + oldsize - PGSIZE), 0);
-                    if (*pte & PTE_P) {
-                        mappages(curproc->pgdir, (void *)(new_addr + oldsize - PGSIZE), PGSIZE, PTE_ADDR(*pte), PTE_W | PTE_U);
+                    pte_t *pte = walkpgdir(vm->pgdir, (void *)(oldaddr + oldsize - PGSIZE), 0);
+                    if (pte && (*pte & PTE_P)) {
+                        mappages(vm->pgdir, (void *)(new_addr + oldsize - PGSIZE), PGSIZE, PTE_ADDR(*pte), PTE_W | PTE_U);
                         *pte = 0;
                     }
                     oldsize -= PGSIZE;
                 }
-                wunmap(oldaddr);
+                // the old range is empty now; this frees its page-table pages
+                // and flushes the moved pages' old addresses from every TLB
+                unmapuvm(vm->pgdir, oldaddr, oldaddr + PGROUNDUP(oldsize_orig));
                 // sort mappings to make it easier to perform other operations
-                selectionSort(curproc->mappings, curproc->num_mappings);
-                return new_mapping.addr;
+                selectionSort(vm->mappings, vm->num_mappings);
+                ret = new_mapping.addr;
             } else {
                 // if it doesn't overlap (can stay at current address), simply expand the mapping size and return old address
-                curproc->mappings[i].length = newsize;
-                return oldaddr;
+                vm->mappings[i].length = newsize;
+                ret = oldaddr;
             }
         }
     }
-    // didn't find anything to remap
-    return FAILED;
+    release(&vm->lock);
+    return ret;
 }
 
 int getpgdirinfo(struct pgdirinfo *pdinfo) {
@@ -235,78 +243,195 @@ int getpgdirinfo(struct pgdirinfo *pdinfo) {
     if (curproc == 0) {
         return FAILED;
     }
-    pde_t *curr_pgdir = curproc->pgdir;
+    // Fill a kernel copy: writing pdinfo could fault, and the
+    // fault handler takes vm->lock
+    struct pgdirinfo info;
+    struct vmspace *vm = curproc->vm;
+    acquire(&vm->lock);
+    pde_t *curr_pgdir = vm->pgdir;
     pte_t *pte;
     uint va = 0;
     int user_allocated_pages = 0;
-    pdinfo->n_upages = 0;
+    info.n_upages = 0;
     // loops through memory to find all user allocated pages within bounds, increments count and stores page size
     while (user_allocated_pages < MAX_UPAGE_INFO && va < KERNBASE) {
         pte = walkpgdir(curr_pgdir, (void*)va, 0);
         if (pte && (*pte & PTE_U)) {
-            pdinfo->n_upages++;
-            pdinfo->va[user_allocated_pages] = va;
-            pdinfo->pa[user_allocated_pages] = PTE_ADDR(*pte);
+            info.n_upages++;
+            info.va[user_allocated_pages] = va;
+            info.pa[user_allocated_pages] = PTE_ADDR(*pte);
             user_allocated_pages++;
         }
         va += PGSIZE;
     }
+    info.n_ptpages = countptpages(curr_pgdir);
+    release(&vm->lock);
+    *pdinfo = info;
     return SUCCESS;
 }
 
 int getwmapinfo(struct wmapinfo *wminfo) {
-    struct proc *curproc = myproc();
-    wminfo->total_mmaps = curproc->num_mappings;
-    for (int i = 0; i < curproc->num_mappings; i++) {
-        wminfo->addr[i] = curproc->mappings[i].addr;
-        wminfo->length[i] = curproc->mappings[i].length;
-        wminfo->n_loaded_pages[i] = curproc->mappings[i].num_pages_loaded;
+    struct vmspace *vm = myproc()->vm;
+    struct wmapinfo info;
+    acquire(&vm->lock);
+    info.total_mmaps = vm->num_mappings;
+    for (int i = 0; i < vm->num_mappings; i++) {
+        info.addr[i] = vm->mappings[i].addr;
+        info.length[i] = vm->mappings[i].length;
+        info.n_loaded_pages[i] = vm->mappings[i].num_pages_loaded;
     }
+    release(&vm->lock);
+    *wminfo = info;
     return SUCCESS;
 }
 
-int handle_pagefault(uint addr) {
+// Give the process a private, writable copy of the shared
+// read-only page that pte maps.  Caller must hold vm->lock.
+static int copyonwrite(pde_t *pgdir, pte_t *pte) {
+    char *old = P2V(PTE_ADDR(*pte));
+    // Nobody else maps it (e.g. the page cache dropped it), so just take it over.
+    // Other CPUs may keep the read-only entry; a write there faults and finds it writable.
+    if (krefcount(old) == 1) {
+        *pte |= PTE_W;
+        lcr3(V2P(pgdir));
+    } else {
+        char *mem = kalloc();
+        if (mem == 0) {
+            return 0;
+        }
+        memmove(mem, old, PGSIZE);
+        *pte = V2P(mem) | PTE_FLAGS(*pte) | PTE_W;
+        // Other threads must stop using the old frame before this one writes the copy
+        tlbshootdown(pgdir);
+        kfree(old);
+    }
+    return 1;
+}
+
+// Map the new page mem at addr, unless another thread faulted
+// it in while vm->lock was dropped.  Returns 1 if mem was
+// mapped, 0 if it was not needed, and -1 on failure.
+// Caller must hold vm->lock.
+static int installpage(struct vmspace *vm, uint addr, char *mem, int perm) {
+    pte_t *pte = walkpgdir(vm->pgdir, (void *)addr, 0);
+    if (pte && (*pte & PTE_P)) {
+        kfree(mem);
+        return 0;
+    }
+    if (mappages(vm->pgdir, (void *)addr, PGSIZE, V2P(mem), perm) != 0) {
+        kfree(mem);
+        return -1;
+    }
+    return 1;
+}
+
+// Threads share the address space, so the page table and the
+// mappings are only examined and changed under vm->lock.  It is
+// dropped around file reads, which may sleep.
+int handle_pagefault(uint addr, uint err) {
     struct proc *curproc = myproc();
+    struct vmspace *vm = curproc->vm;
+    char *mem;
+    int ok;
+    acquire(&vm->lock);
+    pte_t *pte = walkpgdir(vm->pgdir, (void *)addr, 0);
+    if (pte && (*pte & PTE_P)) {
+        ok = 0;
+        if ((*pte & PTE_U) && (!(err & FEC_PR) || ((err & FEC_WR) && (*pte & PTE_W)))) {
+            // Another thread mapped the page, or made it writable, after this fault
+            ok = 1;
+        } else if ((err & FEC_WR) && (*pte & PTE_U) && !(*pte & PTE_W)) {
+            // Writes to shared executable pages get a private copy
+            ok = copyonwrite(vm->pgdir, pte);
+        }
+        // Any other fault on a present page is a protection fault (e.g. the stack guard page)
+        release(&vm->lock);
+        return ok;
+    }
+    // text and data are mapped read-only from the executable page cache on first touch,
+    // bss is zero-filled
+    for (int i = 0; i < vm->nsegs; i++) {
+        struct segment *seg = &vm->segs[i];
+        if (addr >= seg->vaddr && addr < seg->vaddr + seg->memsz) {
+            int perm;
+            uint filend = seg->vaddr + seg->filesz;
+            if (addr < filend) {
+                uint n = filend - addr < PGSIZE ? filend - addr : PGSIZE;
+                uint off = seg->off + (addr - seg->vaddr);
+                // Only exec changes the segments, and it refuses to run with other threads
+                release(&vm->lock);
+                if ((mem = pcget(vm->exe, off, n)) == 0) {
+                    return 0;
+                }
+                acquire(&vm->lock);
+                perm = PTE_U;
+            } else {
+                if ((mem = kalloc()) == 0) {
+                    release(&vm->lock);
+                    return 0;
+                }
+                memset(mem, 0, PGSIZE);
+                perm = PTE_U | PTE_W;
+            }
+            ok = installpage(vm, addr, mem, perm) >= 0;
+            release(&vm->lock);
+            return ok;
+        }
+    }
+    // sbrk only grows sz, so the heap is populated here on first touch
+    if (addr < vm->sz) {
+        mem = kalloc();
+        if (mem == 0) {
+            release(&vm->lock);
+            return 0;
+        }
+        memset(mem, 0, PGSIZE);
+        ok = installpage(vm, addr, mem, PTE_U | PTE_W) >= 0;
+        release(&vm->lock);
+        return ok;
+    }
     // Finds correct page that faults by looping
-    for (int i = 0; i < curproc->num_mappings; i++) {
-        if (addr >= curproc->mappings[i].addr && addr < curproc->mappings[i].addr + curproc->mappings[i].length) {
+    for (int i = 0; i < vm->num_mappings; i++) {
+        if (addr >= vm->mappings[i].addr && addr < vm->mappings[i].addr + vm->mappings[i].length) {
             // Allocate memory w/ kalloc()
-            char *mem = kalloc();
-            int success;
+            mem = kalloc();
             if (mem == 0) {
+                release(&vm->lock);
                 return 0;
             }
-            // lazy allocation: load a page into physical memory
-            curproc->mappings[i].num_pages_loaded++;
-            // If anon map, simply map pages
-            if (curproc->mappings[i].flags & MAP_ANONYMOUS) {
-                success = mappages(curproc->pgdir, (void *)addr, PGSIZE, V2P(mem), PTE_U | PTE_W);
-                if (success != 0) {
-                    kfree(mem);
-                    return 0;
-                } else {
-                    // only allocate page faulted address page
-                    memset(mem, 0, PGSIZE);
-                    return 1;
-                }
-            } else {
-                // file-backed mapping
-                struct file *f = curproc->ofile[curproc->mappings[i].fd];
+            memset(mem, 0, PGSIZE);
+            // If file-backed, read the contents without vm->lock, then look the mapping up again
+            if (!(vm->mappings[i].flags & MAP_ANONYMOUS)) {
+                struct file *f = curproc->fdt->ofile[vm->mappings[i].fd];
+                uint off = addr - vm->mappings[i].addr;
+                release(&vm->lock);
                 // read contents
-                ilock(f->ip);
-                readi(f->ip, mem, addr - curproc->mappings[i].addr, PGSIZE);
+                ilockshared(f->ip);
+                readi(f->ip, mem, off, PGSIZE);
                 iunlock(f->ip);
-                // map contents
-                success = mappages(curproc->pgdir, (void *)addr, PGSIZE, V2P(mem), PTE_U | PTE_W);
-                if (success != 0) {
+                acquire(&vm->lock);
+                for (i = 0; i < vm->num_mappings; i++) {
+                    if (addr >= vm->mappings[i].addr && addr < vm->mappings[i].addr + vm->mappings[i].length) {
+                        break;
+                    }
+                }
+                if (i == vm->num_mappings || vm->mappings[i].addr + off != addr) {
+                    // unmapped or moved meanwhile
                     kfree(mem);
+                    release(&vm->lock);
                     return 0;
-                } else {
-                    return 1;
                 }
             }
+            // lazy allocation: load a page into physical memory
+            int r = installpage(vm, addr, mem, PTE_U | PTE_W);
+            if (r > 0) {
+                vm->mappings[i].num_pages_loaded++;
+            }
+            release(&vm->lock);
+            return r >= 0;
         }
     }
     // didn't find a page to allocate
+    release(&vm->lock);
     return 0;
 }
@@ -117,6 +117,23 @@ sti(void)
   asm volatile("sti");
 }
 
+// Enable interrupts and halt until one arrives.  sti takes
+// effect only after the next instruction, so an interrupt
+// pending at the sti still wakes the hlt.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt");
+}
+
+// Spin-wait hint: saves power and eases the pipeline flush
+// when the awaited store arrives.
+static inline void
+pause(void)
+{
+  asm volatile("pause");
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {
@@ -130,6 +147,16 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Read the time-stamp counter, in cycles.
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
 static inline uint
 rcr2(void)
 {
@@ -144,6 +171,14 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
+static inline uint
+rcr3(void)
+{
+  uint val;
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  return val;
+}
+
 //PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trapasm.S, and passed to trap().